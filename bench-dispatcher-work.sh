@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Compares throughput with and without the dispatcher running requests itself
+# (DISPATCHER_DO_WORK=1) for small numbers of workers, where the dispatcher
+# core is a large share of the cores in use.
+# Writes "workers,do_work,rps,dispatcher-run requests" lines to dispatcher_work.csv.
+# CPUS lists the cores to use, dispatcher and networker first.
+# Extra make variables (e.g. DISPATCHER_WORK_BOUND_NS=1000) are passed through.
+
+LOAD_LEVEL=${LOAD_LEVEL:-90}
+CPUS=${CPUS:-"0,1,2,3,4"}
+CONF=${CONF:-shinjuku.conf}
+declare -a workers=("1" "2" "3")
+OUT=dispatcher_work.csv
+sudo rm -f $OUT temp.txt temp.conf
+touch $OUT
+for w in "${workers[@]}"
+  do
+    # Dispatcher and networker, then w workers.
+    cpu_list=$(echo $CPUS | cut -d, -f1-$((w + 2)))
+    sed "s/^cpu=.*/cpu=[$cpu_list]/" $CONF > temp.conf
+    for do_work in 0 1
+      do
+        echo "Running dispatcher work benchmark for $w workers, DISPATCHER_DO_WORK=$do_work"
+        rm -rf /tmpfs/experiments/leveldb/
+        make clean 2> /dev/null
+        make -j6 -s LOAD_LEVEL=$LOAD_LEVEL FAKE_WORK=1 DISPATCHER_DO_WORK=$do_work "$@" 2> /dev/null
+        sudo ./dp/shinjuku -c temp.conf > temp.txt
+        RPS=$(grep "Dispatched pkts" temp.txt | awk -F': ' '{print $NF}')
+        SELF=$(grep "ran itself" temp.txt | awk -F'ran itself ' '{split($2, a, " "); print a[1]}' | paste -sd ";")
+        echo "$w,$do_work,$RPS,${SELF:-0}" >> $OUT
+      done
+  done
+
+sudo rm -f temp.txt temp.conf
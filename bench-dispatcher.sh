@@ -0,0 +1,22 @@
+#!/bin/bash
+
+# Reports the dispatcher cycles spent per task placed on a worker for a range
+# of load levels. Run it on two checkouts to compare dispatcher changes.
+# Extra make variables (e.g. NUM_DISPATCHERS=2) are passed through.
+
+declare -a load_levels=("10" "30" "50" "70" "90")
+OUT=dispatcher_cycles.csv
+sudo rm -f $OUT temp.txt
+touch $OUT
+for load in "${load_levels[@]}"
+  do
+    echo "Running dispatcher benchmark for load level = $load"
+    rm -rf /tmpfs/experiments/leveldb/
+    make clean 2> /dev/null
+    make -j6 -s LOAD_LEVEL=$load FAKE_WORK=1 DISPATCHER_CYCLE_STATS=1 "$@" 2> /dev/null
+    sudo ./dp/shinjuku > temp.txt
+    CYCLES=$(grep "cycles per placed task" temp.txt | awk -F': ' '{print $NF}' | paste -sd ";")
+    echo "$load,$CYCLES" >> $OUT
+  done
+
+sudo rm -f temp.txt
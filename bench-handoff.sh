@@ -0,0 +1,30 @@
+#!/bin/bash
+
+# Sweeps the networker to dispatcher ring size against the load level.
+# Writes "ring_len,load,rate,full,mean,p50,p99,max" lines to handoff.csv, one
+# per networker/dispatcher pair: the handoff rate in KRps, the pushes refused
+# by a full ring, and the push-to-pop latency in cycles (p50 and p99 are
+# power-of-two upper bounds).
+# Extra make variables (e.g. NUM_NETWORKERS=2) are passed through.
+
+declare -a ring_lens=("8" "32" "128" "512" "2048")
+declare -a load_levels=("10" "50" "90" "100")
+OUT=handoff.csv
+sudo rm -f $OUT temp.txt
+touch $OUT
+for len in "${ring_lens[@]}"
+  do
+  for load in "${load_levels[@]}"
+    do
+      echo "Running handoff benchmark for ring size = $len, load level = $load"
+      rm -rf /tmpfs/experiments/leveldb/
+      make clean 2> /dev/null
+      make -j6 -s LOAD_LEVEL=$load FAKE_WORK=1 HANDOFF_STATS=1 HANDOFF_RING_LEN=$len "$@" 2> /dev/null
+      sudo ./dp/shinjuku > temp.txt
+      grep "Handoff .* - ring" temp.txt | \
+        sed -E 's/.*rate ([0-9]+) KRps, full ([0-9]+), latency \(cycles\) mean ([0-9]+) p50 <([0-9]+) p99 <([0-9]+) max ([0-9]+).*/\1,\2,\3,\4,\5,\6/' | \
+        while read -r line; do echo "$len,$load,$line" >> $OUT; done
+    done
+  done
+
+sudo rm -f temp.txt
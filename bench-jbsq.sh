@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Sweeps the JBSQ depth against the load level to find where deeper per-worker
+# queues stop adding throughput and start hurting tail latency.
+# Writes "jbsq_len,load,rps,p99 latency,p99 slowdown" lines to jbsq.csv.
+# Extra make variables (e.g. SCHEDULE_METHOD=0) are passed through.
+
+PERCENTILE=99
+declare -a jbsq_lens=("1" "2" "4" "8")
+declare -a load_levels=("10" "30" "50" "70" "80" "90" "100")
+OUT=jbsq.csv
+sudo rm -f $OUT temp.csv temp.txt latency.txt slowdown.txt
+touch $OUT
+for k in "${jbsq_lens[@]}"
+  do
+  for load in "${load_levels[@]}"
+    do
+      echo "Running JBSQ benchmark for depth = $k, load level = $load"
+      rm -rf /tmpfs/experiments/leveldb/
+      make clean 2> /dev/null
+      make -j6 -s LOAD_LEVEL=$load FAKE_WORK=1 JBSQ_LEN=$k "$@" 2> /dev/null
+      sudo ./dp/shinjuku > temp.txt
+      RPS=$(grep "Dispatched pkts" temp.txt | awk -F': ' '{print $NF}')
+
+      grep "latency, slowdown" temp.txt | awk -F': ' '{print $(NF-1)}' > latency.txt
+      python3 ../scripts/percentile.py latency.txt temp.csv
+      LATENCY=$(grep "^$PERCENTILE," temp.csv | cut -d "," -f2)
+
+      grep "latency, slowdown" temp.txt | awk -F': ' '{print $NF}' > slowdown.txt
+      python3 ../scripts/percentile.py slowdown.txt temp.csv
+      SLOWDOWN=$(grep "^$PERCENTILE," temp.csv | cut -d "," -f2)
+
+      echo "$k,$load,$RPS,$LATENCY,$SLOWDOWN" >> $OUT
+    done
+  done
+
+sudo rm -f temp.csv temp.txt latency.txt slowdown.txt
@@ -0,0 +1,27 @@
+#!/bin/bash
+
+# Counts the cache misses the dispatcher core takes per loop iteration while
+# polling its workers. Run it on two checkouts to compare shared-state layouts.
+# DISPATCHER_CPU must match the first entry of cpu= in shinjuku.conf.
+# Extra make variables (e.g. NUM_DISPATCHERS=2) are passed through.
+
+LOAD_LEVEL=${LOAD_LEVEL:-50}
+DISPATCHER_CPU=${DISPATCHER_CPU:-0}
+# HITM loads are the ones served from a line another core modified.
+EVENTS=${EVENTS:-"cycles,L1-dcache-load-misses,LLC-load-misses,mem_load_l3_hit_retired.xsnp_hitm"}
+OUT=polling.csv
+
+rm -rf /tmpfs/experiments/leveldb/
+make clean 2> /dev/null
+make -j6 -s LOAD_LEVEL=$LOAD_LEVEL FAKE_WORK=1 DISPATCHER_CYCLE_STATS=1 "$@" 2> /dev/null
+sudo perf stat -C $DISPATCHER_CPU -x, -o perf.txt -e $EVENTS -- ./dp/shinjuku > temp.txt
+
+LOOPS=$(grep "Dispatcher 0 - loops" temp.txt | awk -F': ' '{print $NF}')
+echo "event,count,per loop" > $OUT
+grep -v "^#" perf.txt | grep -v "^$" | while IFS=, read -r count unit event rest
+  do
+    echo "$event,$count,$(echo "scale=4; $count / $LOOPS" | bc)" >> $OUT
+  done
+cat $OUT
+
+sudo rm -f temp.txt perf.txt
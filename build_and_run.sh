@@ -3,6 +3,10 @@
 # Options to pass
 # SCHEDULE_METHOD = < 0, 1, 2, 3 > | < pi, yield, none, concord > 
 # FAKE_WORK = <0,1> 
+# NUM_DISPATCHERS = <1..4>, workers are sharded across the dispatchers
+# NUM_NETWORKERS = <1..4>, each networker polls its own RSS queue
+# JBSQ_LEN = <1, 2, 4, 8>, requests queued per worker (default 2)
+# WORKER_STEALING = <0,1>, idle workers take tasks from their peers' queues
 # RUN_UBENCH = <0,1>
 # -> (if run_ubench == 0) BENCHMARK_TYPE <0, 1, 2, 3, 4, 5> 
 # -> (if run_ubench == 1) BENCHMARK_TYPE <1>
@@ -3,29 +3,22 @@
 #include <stdlib.h>
 #include <new>
 
-
-extern uint8_t flag;
+/*
+ * Exported by the shinjuku binary, whose allocator already defers
+ * preemption around each call. Unresolved when preloaded elsewhere.
+ */
+extern "C" void *__wrap_malloc(size_t sz) __attribute__((weak));
+extern "C" void __wrap_free(void *p) __attribute__((weak));
 
 void *
 operator new(size_t sz)
 {
-  if (flag)
-    asm volatile("cli":::);
-  void *ret = malloc(sz);
-  if (!ret) {
-    if (flag)
-      asm volatile("sti":::);
+  void *ret = __wrap_malloc ? __wrap_malloc(sz) : malloc(sz);
+  if (!ret)
     throw std::bad_alloc();
-  }
-  if (flag)
-    asm volatile("sti":::);
   return ret;
 }
 
-uint8_t * get_flag() {
-  return &flag;
-}
-
 void *
 operator new[](size_t sz)
 {
@@ -35,15 +28,14 @@ operator new[](size_t sz)
 void
 operator delete(void *p)
 {
-  if (flag)
-    asm volatile("cli":::);
-  free(p);
-  if (flag)
-    asm volatile("sti":::);
+  if (__wrap_free)
+    __wrap_free(p);
+  else
+    free(p);
 }
 
 void
 operator delete[](void *p)
 {
   ::operator delete(p);
-}
\ No newline at end of file
+}
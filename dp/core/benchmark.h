@@ -26,15 +26,56 @@
 #define METHOD_YIELD    1
 #define METHOD_NONE     2
 #define METHOD_CONCORD  3
+// Concord flag first, posted IPI once preempt_grace runs out
+#define METHOD_HYBRID   4
+// Workers check their own deadline at rdtsc probes; needs the library built
+// with the rdtsc pass
+#define METHOD_RDTSC    5
+
+// Set by the Makefile when it links the libraries built with the rdtsc pass
+#ifndef CONCORD_RDTSC_LIBS
+#define CONCORD_RDTSC_LIBS 0
+#endif
+#if SCHEDULE_METHOD == METHOD_RDTSC && CONCORD_RDTSC_LIBS == 0
+#error "METHOD_RDTSC needs the _rdtsc libraries: build with make SCHEDULE_METHOD=METHOD_RDTSC"
+#endif
 
 // Debug Methods
 #define LATENCY_DEBUG   1
 
+// If 1, reports dispatcher cycles spent per task placed on a worker
+#ifndef DISPATCHER_CYCLE_STATS
+#define DISPATCHER_CYCLE_STATS 0
+#endif
+
+// If 1, retunes the preemption time slice from observed service times
+#ifndef ADAPTIVE_QUANTUM
+#define ADAPTIVE_QUANTUM 0
+#endif
+
+// If 1, worker 0 measures the context switch round trip of each fpu_save mode
+// and the cost of starting a request
+#ifndef CONTEXT_SWITCH_BENCH
+#define CONTEXT_SWITCH_BENCH 0
+#endif
+
+// If 1, workers log Concord preemption flags, yields and lock hold times
+// to preempt_trace.bin at the end of the run, see dp/parsetrace.py
+#ifndef PREEMPT_TRACE
+#define PREEMPT_TRACE 0
+#endif
+
 // Dispatcher do work
 #ifndef DISPATCHER_DO_WORK
 #define DISPATCHER_DO_WORK 0
 #endif
 
+// Longest the dispatcher runs a request of its own before going back to
+// dispatching, in ns
+#ifndef DISPATCHER_WORK_BOUND_NS
+#define DISPATCHER_WORK_BOUND_NS 2000
+#endif
+
 // If 0, runs leveldb. If 1 runs simpleloop
 #ifndef RUN_UBENCH
 #define RUN_UBENCH      1  
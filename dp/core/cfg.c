@@ -49,6 +49,8 @@
 #include <ix/ethdev.h>
 #include <ix/dispatch.h>
 
+#include "benchmark.h"
+
 #define DEFAULT_CONF_FILE "./shinjuku.conf"
 
 struct cfg_parameters CFG;
@@ -63,11 +65,21 @@ int req_offset = 1;
 static int parse_host_addr(void);
 static int parse_port(void);
 static int parse_slo(void);
+static int parse_quantum(void);
+static int parse_priority(void);
+static int parse_sched_policy(void);
+static int parse_fpu_save(void);
+static int parse_stack_size(void);
+static int parse_preempt_grace(void);
+static int parse_reassembly_timeout(void);
+static int parse_tx_batch(void);
+static int parse_tx_deadline(void);
 static int parse_gateway_addr(void);
 static int parse_arp(void);
 static int parse_devices(void);
 static int parse_cpu(void);
 static int parse_loader_path(void);
+static int parse_plugin_path(void);
 
 struct config_vector_t {
 	const char *name;
@@ -78,11 +90,21 @@ static struct config_vector_t config_tbl[] = {
 	{ "host_addr",    parse_host_addr},
 	{ "port",         parse_port},
 	{ "slo",          parse_slo},
+	{ "quantum",      parse_quantum},
+	{ "priority",     parse_priority},
+	{ "sched_policy", parse_sched_policy},
+	{ "fpu_save",     parse_fpu_save},
+	{ "stack_size",   parse_stack_size},
+	{ "preempt_grace", parse_preempt_grace},
+	{ "reassembly_timeout", parse_reassembly_timeout},
+	{ "tx_batch",     parse_tx_batch},
+	{ "tx_deadline",  parse_tx_deadline},
 	{ "gateway_addr", parse_gateway_addr},
 	{ "arp",          parse_arp},
 	{ "devices",      parse_devices},
 	{ "cpu",          parse_cpu},
 	{ "loader_path",  parse_loader_path},
+	{ "plugin_path",  parse_plugin_path},
 	{ NULL,           NULL}
 };
 
@@ -200,7 +222,8 @@ static int parse_port(void)
 
 static int add_slo(int slo)
 {
-	CFG.slos[CFG.num_slos] = 2.5 * slo;
+	CFG.slos[CFG.num_slos] = slo;
+	CFG.slo_cycles[CFG.num_slos] = slo * CPU_FREQ_GHZ;
 	++CFG.num_slos;
 	return 0;
 }
@@ -227,6 +250,266 @@ static int parse_slo(void)
 	return 0;
 }
 
+/*
+ * Parses the optional setting @name, either a single value or a list of up to
+ * CFG_MAX_PORTS values, one per port. @add appends a value to the CFG array
+ * counted by @count.
+ */
+static int parse_int_list(const char *name, int *count, int (*add)(int))
+{
+	const config_setting_t *list = NULL;
+	int ret;
+
+	*count = 0;
+	list = config_lookup(&cfg, name);
+	if (!list)
+		return 0;
+	if (config_setting_type(list) != CONFIG_TYPE_LIST &&
+	    config_setting_type(list) != CONFIG_TYPE_ARRAY)
+		return add(config_setting_get_int(list));
+	while (*count < CFG_MAX_PORTS && *count < config_setting_length(list)) {
+		ret = add(config_setting_get_int_elem(list, *count));
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Same as parse_int_list(), for settings holding strings. */
+static int parse_string_list(const char *name, int *count,
+			     int (*add)(const char *))
+{
+	const config_setting_t *list = NULL;
+	int ret;
+
+	*count = 0;
+	list = config_lookup(&cfg, name);
+	if (!list)
+		return 0;
+	if (config_setting_type(list) != CONFIG_TYPE_LIST &&
+	    config_setting_type(list) != CONFIG_TYPE_ARRAY)
+		return add(config_setting_get_string(list));
+	while (*count < CFG_MAX_PORTS && *count < config_setting_length(list)) {
+		ret = add(config_setting_get_string_elem(list, *count));
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int add_quantum(int quantum)
+{
+	if (quantum < 0)
+		return -EINVAL;
+	CFG.quanta[CFG.num_quanta] = quantum;
+	++CFG.num_quanta;
+	return 0;
+}
+
+/*
+ * quantum is optional. When given, it holds the preemption time slice of each
+ * request type in ns, 0 meaning run to completion.
+ */
+static int parse_quantum(void)
+{
+	return parse_int_list("quantum", &CFG.num_quanta, add_quantum);
+}
+
+static int add_priority(int prio)
+{
+	if (prio < 0 || prio >= SCHED_MAX_CLASSES)
+		return -EINVAL;
+	CFG.prios[CFG.num_prios] = prio;
+	++CFG.num_prios;
+	if (prio >= CFG.sched_classes)
+		CFG.sched_classes = prio + 1;
+	return 0;
+}
+
+/*
+ * priority is optional. When given, it holds the dispatch priority class of
+ * each request type, 0 being the highest. Types without an entry are in
+ * class 0.
+ */
+static int parse_priority(void)
+{
+	CFG.sched_classes = 1;
+	return parse_int_list("priority", &CFG.num_prios, add_priority);
+}
+
+static const char *sched_policy_names[] = {
+	[SCHED_FCFS] = "fcfs",
+	[SCHED_SLO]  = "slo",
+	[SCHED_SRPT] = "srpt",
+	[SCHED_EDF]  = "edf",
+	NULL,
+};
+
+static int parse_sched_policy(void)
+{
+	const char *parsed = NULL;
+	int i;
+
+	CFG.sched_policy = SCHED_FCFS;
+	config_lookup_string(&cfg, "sched_policy", &parsed);
+	if (!parsed)
+		return 0;
+	for (i = 0; sched_policy_names[i]; i++) {
+		if (!strcmp(parsed, sched_policy_names[i]))
+			break;
+	}
+	if (!sched_policy_names[i]) {
+		log_err("cfg: unknown scheduling policy '%s'\n", parsed);
+		return -EINVAL;
+	}
+	CFG.sched_policy = i;
+	if ((i == SCHED_SLO || i == SCHED_EDF) && CFG.num_slos < CFG.num_ports) {
+		log_err("cfg: sched_policy=\"%s\" needs one slo per port\n", parsed);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+const char *fpu_save_names[] = {
+	[FPU_SAVE_NONE]  = "none",
+	[FPU_SAVE_ENV]   = "env",
+	[FPU_SAVE_XSAVE] = "xsave",
+	NULL,
+};
+
+static int add_fpu_save(const char *name)
+{
+	int i;
+
+	if (!name)
+		return -EINVAL;
+	for (i = 0; fpu_save_names[i]; i++) {
+		if (!strcmp(name, fpu_save_names[i]))
+			break;
+	}
+	if (!fpu_save_names[i]) {
+		log_err("cfg: unknown fpu_save mode '%s'\n", name);
+		return -EINVAL;
+	}
+	CFG.fpu_saves[CFG.num_fpu_saves] = i;
+	++CFG.num_fpu_saves;
+	return 0;
+}
+
+/*
+ * fpu_save is optional. When given, it holds the extended state a preempted
+ * request of each type keeps across the switch. Types without an entry use
+ * "env".
+ */
+static int parse_fpu_save(void)
+{
+	return parse_string_list("fpu_save", &CFG.num_fpu_saves, add_fpu_save);
+}
+
+static int add_stack_size(int size)
+{
+	int cls;
+
+	switch (size) {
+	case 4096:
+		cls = STACK_CLASS_4KB;
+		break;
+	case 16384:
+		cls = STACK_CLASS_16KB;
+		break;
+	case 65536:
+		cls = STACK_CLASS_64KB;
+		break;
+	default:
+		log_err("cfg: stack_size must be 4096, 16384 or 65536, not %d\n", size);
+		return -EINVAL;
+	}
+	CFG.stack_sizes[CFG.num_stack_sizes] = cls;
+	++CFG.num_stack_sizes;
+	return 0;
+}
+
+/*
+ * stack_size is optional. When given, it holds the stack size, in bytes, of
+ * the requests of each type. Types without an entry get 16384 bytes.
+ */
+static int parse_stack_size(void)
+{
+	return parse_int_list("stack_size", &CFG.num_stack_sizes, add_stack_size);
+}
+
+/*
+ * preempt_grace is optional. It is how long, in ns, a worker whose Concord
+ * flag was raised gets to reach a probe before METHOD_HYBRID sends an IPI.
+ */
+static int parse_preempt_grace(void)
+{
+	int grace;
+
+	CFG.preempt_grace = PREEMPT_GRACE_DEFAULT;
+	if (!config_lookup_int(&cfg, "preempt_grace", &grace))
+		return 0;
+	if (grace < 0)
+		return -EINVAL;
+	CFG.preempt_grace = grace;
+	return 0;
+}
+
+/*
+ * reassembly_timeout is optional. It is how long, in us, a networker keeps
+ * the packets of a request that is still missing some before dropping them.
+ */
+static int parse_reassembly_timeout(void)
+{
+	int timeout;
+
+	CFG.reassembly_timeout = REASSEMBLY_TIMEOUT_DEFAULT;
+	if (!config_lookup_int(&cfg, "reassembly_timeout", &timeout))
+		return 0;
+	if (timeout <= 0 || timeout > 60 * 1000 * 1000) {
+		log_err("cfg: reassembly_timeout must be between 1 and 60000000 us\n");
+		return -EINVAL;
+	}
+	CFG.reassembly_timeout = timeout;
+	return 0;
+}
+
+/*
+ * tx_batch and tx_deadline are optional. A worker holds up to tx_batch
+ * responses before sending them to the NIC together. It does not start a
+ * request that could keep them past tx_deadline us, and never holds them
+ * while it has no request to run.
+ */
+static int parse_tx_batch(void)
+{
+	int batch;
+
+	CFG.tx_batch = TX_BATCH_DEFAULT;
+	if (!config_lookup_int(&cfg, "tx_batch", &batch))
+		return 0;
+	if (batch <= 0 || batch > TX_BATCH_MAX) {
+		log_err("cfg: tx_batch must be between 1 and %d\n", TX_BATCH_MAX);
+		return -EINVAL;
+	}
+	CFG.tx_batch = batch;
+	return 0;
+}
+
+static int parse_tx_deadline(void)
+{
+	int deadline;
+
+	CFG.tx_deadline = TX_DEADLINE_DEFAULT;
+	if (!config_lookup_int(&cfg, "tx_deadline", &deadline))
+		return 0;
+	if (deadline < 0) {
+		log_err("cfg: tx_deadline must be 0 or more us\n");
+		return -EINVAL;
+	}
+	CFG.tx_deadline = deadline;
+	return 0;
+}
+
 static int parse_host_addr(void)
 {
 	char *parsed = NULL, *ip = NULL, *bitmask = NULL;
@@ -346,6 +629,22 @@ static int parse_loader_path(void)
 	return 0;
 }
 
+/*
+ * plugin_path is optional. It is the rdtsc-instrumented library the
+ * dispatcher loads to run requests itself with DISPATCHER_DO_WORK=1.
+ */
+static int parse_plugin_path(void)
+{
+	char *parsed = NULL;
+
+	config_lookup_string(&cfg, "plugin_path", (const char **)&parsed);
+	if (!parsed)
+		parsed = PLUGIN_PATH_DEFAULT;
+	strncpy(CFG.plugin_path, parsed, sizeof(CFG.plugin_path));
+	CFG.plugin_path[sizeof(CFG.plugin_path) - 1] = '\0';
+	return 0;
+}
+
 static int parse_conf_file(const char *path)
 {
 	int ret, i;
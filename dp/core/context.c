@@ -24,51 +24,115 @@
  * context.c - context management
  */
 
+#include <cpuid.h>
+#include <errno.h>
 #include <ucontext.h>
 
 #include <ix/stddef.h>
+#include <ix/cfg.h>
 #include <ix/context.h>
+#include <ix/log.h>
 #include <ix/mempool.h>
 
+#include "benchmark.h"
+
 #define CONTEXT_CAPACITY    768*1024
-#define STACK_CAPACITY      (768*1024) / 2
-#define STACK_SIZE          2048 * 2
 
-static int context_init_mempool(void)
+DEFINE_PERCPU(struct mempool, context_pools[STACK_MAX_NODES] __attribute__((aligned(64))));
+
+uint64_t xstate_mask;
+
+static bool context_uses_xsave(void)
 {
-        struct mempool *m = &context_pool;
-        return mempool_create(m, &context_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+        int i;
+
+        for (i = 0; i < CFG.num_fpu_saves; i++) {
+                if (CFG.fpu_saves[i] == FPU_SAVE_XSAVE)
+                        return true;
+        }
+        return false;
 }
 
-static int stack_init_mempool(void)
+/*
+ * xstate_init - checks for XSAVEOPT and XINUSE reporting and reads which
+ * of the lazily switched components the OS enabled
+ */
+static int xstate_init(void)
 {
-        struct mempool *m = &stack_pool;
-        return mempool_create(m, &stack_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+        unsigned int eax, ebx, ecx, edx;
+
+        __cpuid(1, eax, ebx, ecx, edx);
+        if (!(ecx & bit_OSXSAVE))
+                return -ENOTSUP;
+        /* EAX bit 0 is XSAVEOPT, bit 2 XGETBV with ECX=1. */
+        __cpuid_count(0xd, 1, eax, ebx, ecx, edx);
+        if ((eax & 0x5) != 0x5)
+                return -ENOTSUP;
+
+        xstate_mask = xgetbv(0) & (XSTATE_SSE | XSTATE_AVX);
+        if (!(xstate_mask & XSTATE_SSE))
+                return -ENOTSUP;
+        return 0;
 }
 
 /**
- * context_init - allocates global context and stack datastores
+ * context_init - allocates the stacks and a context datastore per NUMA node
+ *
+ * Contexts get room for an XSAVE area when a request type uses it. Each node
+ * with workers gets a share of the contexts, like it does of the stacks.
  */
 int context_init(void)
 {
-        int ret;
-        ret = mempool_create_datastore(&context_datastore, CONTEXT_CAPACITY,
-                                       sizeof(ucontext_t), 1,
-                                       MEMPOOL_DEFAULT_CHUNKSIZE,
-                                       "context");
-        if (ret)
-                return ret;
+        size_t context_size = sizeof(ucontext_t);
+        int node, ret;
 
-        ret = context_init_mempool();
-        if (ret)
-                return ret;
+        if (context_uses_xsave()) {
+                ret = xstate_init();
+                if (ret) {
+                        log_err("context: fpu_save=\"xsave\" needs XSAVEOPT and XINUSE support\n");
+                        return ret;
+                }
+                context_size += sizeof(struct xstate);
+        } else if (CONTEXT_SWITCH_BENCH) {
+                xstate_init();
+        }
 
-        ret = mempool_create_datastore(&stack_datastore, STACK_CAPACITY,
-                                       STACK_SIZE, 1, MEMPOOL_DEFAULT_CHUNKSIZE,
-                                       "stack");
+        ret = stack_init();
         if (ret)
                 return ret;
 
-        ret = stack_init_mempool();
-        return ret;
+        for (node = 0; node < STACK_MAX_NODES; node++) {
+                if (!stack_classes[node][0].end)
+                        continue;
+                ret = mempool_create_datastore_on_node(&context_datastores[node],
+                                                       stack_node_share(CONTEXT_CAPACITY, node),
+                                                       context_size, 1,
+                                                       MEMPOOL_DEFAULT_CHUNKSIZE,
+                                                       "context", node);
+                if (ret)
+                        return ret;
+        }
+        return 0;
+}
+
+/**
+ * context_init_cpu - allocates the per cpu context mempool of every node
+ *
+ * Contexts are allocated and freed by the dispatchers, each from its own pool.
+ * Stacks come from the per cpu caches of stack.c.
+ */
+int context_init_cpu(void)
+{
+        int node, ret;
+
+        for (node = 0; node < STACK_MAX_NODES; node++) {
+                if (!context_datastores[node].magic)
+                        continue;
+                ret = mempool_create(&percpu_get(context_pools)[node],
+                                     &context_datastores[node],
+                                     MEMPOOL_SANITY_PERCPU, percpu_get(cpu_id));
+                if (ret)
+                        return ret;
+        }
+        return 0;
 }
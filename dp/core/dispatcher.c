@@ -23,8 +23,11 @@
 /*
  * dispatcher.c - dispatcher core functionality
  *
- * A single core is responsible for receiving network packets from the network
- * core and dispatching these packets or contexts to the worker cores.
+ * A dispatcher core is responsible for receiving network packets from the
+ * network core and dispatching these packets or contexts to the worker cores.
+ * With NUM_DISPATCHERS > 1 the workers are split into contiguous shards, each
+ * served by its own dispatcher with a private task queue and idle list. A
+ * dispatcher that runs dry steals surplus tasks from the others.
  */
 
 #include <stdio.h>
@@ -34,6 +37,8 @@
 #include <ix/transmit.h>
 
 #include <ix/networker.h>
+#include <ix/preempt_trace.h>
+#include <ix/quantum.h>
 #include <net/ip.h>
 #include <net/udp.h>
 
@@ -41,7 +46,6 @@
 #include "benchmark.h"
 // Added for leveldb
 #include <ix/leveldb.h>
-#include <ix/hijack.h>
 #include <leveldb/c.h>
 #include <dlfcn.h>
 #include "dl-helpers.h"
@@ -61,18 +65,55 @@ volatile uint64_t TEST_RCVD_DB_DELETE;
 volatile uint64_t TEST_RCVD_DB_SEEK;
 volatile uint64_t TEST_TOTAL_PACKETS_COUNTER = 0; 
 volatile bool 	 TEST_FINISHED = false;
-uint64_t dispatched_pkts = 0;
+
+struct dispatcher_stats {
+        uint64_t dispatched_pkts;
+        uint64_t stolen_tasks;
+        uint64_t dropped_pkts;
+        uint64_t placed_tasks;
+        uint64_t busy_cycles;
+        uint64_t loops;
+        uint64_t completions;
+        uint64_t preemptions;
+        uint64_t quantum_ns;
+        uint64_t self_completions;   /* requests the dispatcher ran itself */
+        uint64_t self_preemptions;
+} __attribute__((aligned(64)));
+struct dispatcher_stats dispatcher_stats[NUM_DISPATCHERS];
 
 extern void dune_apic_send_posted_ipi(uint8_t vector, uint32_t dest_core);
 
 #define PREEMPT_VECTOR 0xf2
 #define PREEMPTION_DELAY 5000
+/* Requests taken off a networker's ring per dispatcher loop. */
+#define HANDOFF_POP_BUDGET 16
 
 uint16_t num_workers = 0;
 volatile int * cpu_preempt_points [MAX_WORKERS] = {NULL};
-uint64_t epoch_slack;
-uint64_t time_slice = PREEMPTION_DELAY*CPU_FREQ_GHZ;
-uint64_t dispatcher_work_thresh;
+__thread uint64_t epoch_slack;
+__thread uint64_t time_slice = PREEMPTION_DELAY*CPU_FREQ_GHZ;
+__thread uint64_t dispatcher_work_thresh;
+
+__thread struct fini_request_queue frqueue[NUM_NETWORKERS];
+
+/* Per-dispatcher shard of workers: [shard_first, shard_first + shard_workers) */
+static __thread uint8_t dispatcher_id;
+static __thread uint8_t shard_first;
+static __thread uint8_t shard_workers;
+/* NUMA node most of the shard's workers run on. */
+static __thread uint8_t shard_node;
+/*
+ * occupancy_masks[n] has bit i set when worker i holds n requests, so the
+ * least loaded worker with a free JBSQ slot is found with one ctz per level.
+ */
+static __thread uint64_t occupancy_masks[JBSQ_LEN + 1];
+static __thread bool steal_pending;
+static __thread uint8_t steal_victim;
+static __thread uint64_t next_retune;
+static __thread uint64_t type_slices[CFG_MAX_PORTS];
+#if NUM_NETWORKERS > 1
+static __thread uint8_t next_networker;
+#endif
 
 #define DISPATCHER_STATS_ITERATOR_LIMIT 1
 struct dispatcher_timestamping {
@@ -94,19 +135,48 @@ extern int swapcontext_very_fast(ucontext_t *ouctx, ucontext_t *uctx);
 
 extern void concord_enable();
 extern void concord_disable();
+extern void concord_func();
 
 __thread uint64_t concord_preempt_after_cycle;
 __thread uint64_t concord_start_time;
-char* plugin_file = "../benchmarks/leveldb/lib/concord_apileveldb_rdtsc.so";
+/* Cap on concord_preempt_after_cycle for the dispatcher's own requests. */
+static __thread uint64_t dispatcher_work_bound = DISPATCHER_WORK_BOUND_NS * CPU_FREQ_GHZ;
+
+extern __thread void (*concord_pending_yield)(void);
 
 void concord_rdtsc_func()
 {
-    if (concord_lock_counter != 0 || unlikely(!INIT_FINISHED))
+    if (unlikely(!INIT_FINISHED))
         return;
-    swapcontext(dispatcher_cont, &dispatcher_uctx_main);
+    if (concord_lock_counter != 0) {
+        /* Taken by concord_disable() once the lock is released. */
+        concord_pending_yield = concord_rdtsc_func;
+        return;
+    }
+#if SCHEDULE_METHOD == METHOD_RDTSC
+    /*
+     * Only the dispatcher runs requests in dispatcher_cont: this is a worker
+     * past the deadline it set itself in arm_preemption().
+     */
+    if (!dispatcher_cont) {
+        concord_func();
+        return;
+    }
+#endif
+    swapcontext_fast_to_control(dispatcher_cont, &dispatcher_uctx_main);
+}
+
+/*
+ * Probe for the loops of the dispatcher's own request handlers, which are not
+ * built with the rdtsc pass.
+ */
+static inline void dispatcher_probe(void)
+{
+    if (unlikely(rdtsc() - concord_start_time > concord_preempt_after_cycle))
+        concord_rdtsc_func();
 }
 
-struct dispatcher_request dispatcher_job;
+__thread struct dispatcher_request dispatcher_job;
 __thread uint8_t dispatcher_job_status = IDLE;
 
 // Added for leveldb support
@@ -116,40 +186,66 @@ extern leveldb_options_t *options;
 extern leveldb_readoptions_t *roptions;
 extern leveldb_writeoptions_t *woptions;
 
-static void preempt_check_init()
+static void dispatch_states_init()
 {
-	int i;
-	for (i = 0; i < num_workers; i++){
-		preempt_check[i].check = false;
-		preempt_check[i].timestamp = MAX_UINT64;
+	int i, j;
+	for (i = 0; i < shard_workers; i++){
+		dispatch_states[shard_first + i].next_push = 0;
+		dispatch_states[shard_first + i].next_pop = 0;
+		dispatch_states[shard_first + i].occupancy = 0;
+		for (j = 0; j < JBSQ_LEN; j++)
+			dispatch_states[shard_first + i].taken[j] =
+				worker_status[shard_first + i].flags[j];
+		dispatch_states[shard_first + i].preempted_run = 0;
 	}
+	for (i = 0; i <= JBSQ_LEN; i++)
+		occupancy_masks[i] = 0;
+	occupancy_masks[0] = ((1ULL << shard_workers) - 1) << shard_first;
 }
 
-static void dispatch_states_init()
+static inline void set_occupancy(uint8_t i, uint8_t occupancy)
 {
-	int i;
-	for (i = 0; i < num_workers; i++){
-		dispatch_states[i].next_push = 0;
-		dispatch_states[i].next_pop = 0;
-		dispatch_states[i].occupancy = 0;
-        idle_list[i] = i;
+	occupancy_masks[dispatch_states[i].occupancy] &= ~(1ULL << i);
+	occupancy_masks[occupancy] |= 1ULL << i;
+	dispatch_states[i].occupancy = occupancy;
+}
+
+/**
+ * least_loaded_worker - returns the worker with the fewest queued requests
+ *
+ * Returns -1 if every worker of the shard has a full JBSQ.
+ */
+static inline int least_loaded_worker(void)
+{
+	uint8_t level;
+
+	for (level = 0; level < JBSQ_LEN; level++) {
+		if (occupancy_masks[level])
+			return ctz64(occupancy_masks[level]);
 	}
-    idle_list_head = 0;
+	return -1;
+}
+
+/* NUMA node of a worker, which new contexts are placed on. */
+static inline int worker_node(uint8_t i)
+{
+	return cpu_nodes[CFG.cpu[i + WORKER_CPU_BASE]];
 }
 
 static void requests_init() {
 	int i;
-	for (i=0; i < num_workers; i++){
+	for (i = shard_first; i < shard_first + shard_workers; i++){
 		for(uint8_t j = 0; j < JBSQ_LEN; j++)
 		dispatcher_requests[i].requests[j].flag = INACTIVE;
 	}
 }
 
+#if DISPATCHER_DO_WORK == 1
 static void dispatcher_dl_init(){
-    printf("Loading plugin: %s\n", plugin_file);
+    printf("Loading plugin: %s\n", CFG.plugin_path);
     dlerror();
     char *err = NULL;
-    void *plugin = dlopen(plugin_file, RTLD_NOW);
+    void *plugin = dlopen(CFG.plugin_path, RTLD_NOW);
     if ((err = dlerror())) {
         printf("Error loading plugin: %s\n",err);
         exit(-1);
@@ -177,32 +273,143 @@ static void dispatcher_dl_init(){
     }
     assert(dl_cncrd_leveldb_scan);
 }
+#endif
 
+/* Queues a request to be handed back to the networker it came from. */
+static inline void request_retire(struct request * req)
+{
+	if (likely(req))
+		request_enqueue(&frqueue[req->networker], req);
+}
 
-static inline void handle_finished(uint8_t i, uint8_t active_req)
+static inline void complete_task(void * rnbl, struct request * req, uint8_t type)
 {
-	if (worker_responses[i].responses[active_req].req == NULL)
+	if (req == NULL)
 		log_warn("No mbuf was returned from worker\n");
+#if ADAPTIVE_QUANTUM == 1
+	else
+		service_hist_record(sched_port(type), req->service_ns);
+#endif
+	dispatcher_stats[dispatcher_id].completions++;
 
-	context_free(worker_responses[i].responses[active_req].rnbl);
-        request_enqueue(&frqueue, (struct request *) worker_responses[i].responses[active_req].req);
-        worker_responses[i].responses[active_req].flag = PROCESSED;
+	context_free(rnbl, type);
+	request_retire(req);
+}
+
+static inline void requeue_task(void * rnbl, struct request * req, uint8_t type,
+				uint8_t category, uint64_t timestamp)
+{
+	if (unlikely(sched_enqueue(rnbl, req, type, category, timestamp)))
+		log_err("Task queue full, lost preempted context\n");
+	dispatcher_stats[dispatcher_id].preemptions++;
+}
+
+static inline void handle_finished(uint8_t i, uint8_t active_req)
+{
+	complete_task(worker_responses[i].responses[active_req].rnbl,
+		      worker_responses[i].responses[active_req].req,
+		      worker_responses[i].responses[active_req].type);
 }
 
 static inline void handle_preempted(uint8_t i, uint8_t active_req)
 {
+	requeue_task(worker_responses[i].responses[active_req].rnbl,
+		     worker_responses[i].responses[active_req].req,
+		     worker_responses[i].responses[active_req].type,
+		     worker_responses[i].responses[active_req].category,
+		     worker_responses[i].responses[active_req].timestamp);
+}
+
+#if WORKER_STEALING == 1
+/**
+ * handle_local_results - collects what a worker finished or gave up
+ * @i: the worker
+ *
+ * The results ring holds every task the worker ran, including those it took
+ * from a peer's deque.
+ */
+static inline void handle_local_results(uint8_t i)
+{
+	struct local_results * r = &local_results[i];
+	struct task_result * res;
+	uint32_t head = r->head, tail = r->tail;
+
+	barrier();
+	for (; head != tail; head++) {
+		res = &r->results[head & LOCAL_RESULTS_MASK];
+		if (res->flag == FINISHED)
+			complete_task(res->rnbl, res->req, res->type);
+		else
+			requeue_task(res->rnbl, res->req, res->type, CONTEXT,
+				     res->timestamp);
+	}
+	barrier();
+	r->head = head;
+}
+
+/* Worker of the shard, counted from shard_first, topped up first. */
+static __thread int fill_next;
+
+/**
+ * fill_local_deques - tops up the local deque of every worker of the shard
+ * @cur_time: the current timestamp
+ *
+ * Each deque is refilled to LOCAL_DEQUE_FILL tasks and published with a
+ * single tail update. When tasks run out, the next call starts with the
+ * workers this one did not serve, so low load is spread over all of them.
+ */
+static inline void fill_local_deques(uint64_t cur_time)
+{
+	struct local_deque * dq;
 	void *rnbl;
-        struct request* req;
+	struct request *req;
 	uint8_t type, category;
 	uint64_t timestamp;
+	uint32_t tail, n, start;
+	int i, k;
+
+	for (k = 0; k < shard_workers; k++) {
+		i = shard_first + (fill_next + k) % shard_workers;
+		dq = &local_deques[i];
+		tail = dq->tail;
+		n = start = local_deque_len(dq);
+		for (; n < LOCAL_DEQUE_FILL; n++, tail++) {
+			if (sched_dequeue(&rnbl, &req, &type, &category,
+					  &timestamp, cur_time))
+				break;
+			if (category == PACKET)
+				rnbl = context_place(rnbl, type, worker_node(i));
+			tskq_fill(&dq->tasks[tail & LOCAL_DEQUE_MASK], rnbl, req,
+				  type, category, timestamp, 0);
+#if DISPATCHER_CYCLE_STATS == 1
+			dispatcher_stats[dispatcher_id].placed_tasks++;
+#endif
+		}
+		barrier();
+		dq->tail = tail;
+		if (n < LOCAL_DEQUE_FILL) {
+			/* Out of tasks: the next round starts past the last worker served. */
+			fill_next = (fill_next + k + (n > start)) % shard_workers;
+			return;
+		}
+	}
+}
+#endif
+
+/* Whether some worker of the shard could take a task right away. */
+static inline bool shard_has_idle_worker(void)
+{
+#if WORKER_STEALING == 1
+	int i;
 
-	rnbl = worker_responses[i].responses[active_req].rnbl;
-	req = worker_responses[i].responses[active_req].req;
-	category = worker_responses[i].responses[active_req].category;
-	type = worker_responses[i].responses[active_req].type;
-	timestamp = worker_responses[i].responses[active_req].timestamp;
-	tskq_enqueue_tail(&tskq, rnbl, req, type, category, timestamp);
-	worker_responses[i].responses[active_req].flag = PROCESSED;
+	for (i = shard_first; i < shard_first + shard_workers; i++) {
+		if (!local_deque_len(&local_deques[i]))
+			return true;
+	}
+	return false;
+#else
+	return occupancy_masks[0] != 0;
+#endif
 }
 
 static inline void dispatch_requests(uint64_t cur_time)
@@ -215,26 +422,14 @@ static inline void dispatch_requests(uint64_t cur_time)
 
         int idle;
 
-		if(likely(idle_list_head < num_workers)){
-            idle = idle_list[idle_list_head];
-            idle_list_head++;
-            if (tskq_dequeue(&tskq, &rnbl, &req, &type,
-                                &category, &timestamp)){
-                idle_list_head--;
-                return;
-            }
-        }
-        else{
-            for (idle = 0; idle < num_workers; idle++){
-                if(dispatch_states[idle].occupancy == 1)
-                   break;
-            }
-            if(idle == num_workers)
-                return;
-            if (tskq_dequeue(&tskq, &rnbl, &req, &type,
-                                &category, &timestamp))
-                return;
-        }
+        idle = least_loaded_worker();
+        if (idle < 0)
+            return;
+        if (sched_dequeue(&rnbl, &req, &type,
+                            &category, &timestamp, cur_time))
+            return;
+		if (category == PACKET)
+			rnbl = context_place(rnbl, type, worker_node(idle));
 		uint8_t active_req = dispatch_states[idle].next_push;
 		dispatcher_requests[idle].requests[active_req].rnbl = rnbl;
 		dispatcher_requests[idle].requests[active_req].req = req;
@@ -243,43 +438,168 @@ static inline void dispatch_requests(uint64_t cur_time)
 		dispatcher_requests[idle].requests[active_req].timestamp = timestamp;
 		dispatcher_requests[idle].requests[active_req].flag = READY;
 		jbsq_get_next(&(dispatch_states[idle].next_push));
-		dispatch_states[idle].occupancy++;
+		set_occupancy(idle, dispatch_states[idle].occupancy + 1);
+#if DISPATCHER_CYCLE_STATS == 1
+		dispatcher_stats[dispatcher_id].placed_tasks++;
+#endif
 
 	}
 }
 
+static inline uint64_t port_time_slice(uint8_t port)
+{
+	if (port < CFG.num_quanta)
+		return type_slices[port];
+	return time_slice;
+}
+
+/**
+ * worker_time_slice - returns the time slice of the request running on a worker
+ * @i: the worker
+ *
+ * Types with a quantum= entry use it, the others share time_slice.
+ */
+static inline uint64_t worker_time_slice(uint8_t i)
+{
+	return port_time_slice(sched_port(worker_status[i].type));
+}
+
+/*
+ * Hands the time slices over to the workers of the shard, which need them to
+ * preempt themselves.
+ */
+static void publish_time_slices(void)
+{
+	int i, port;
+
+	for (i = shard_first; i < shard_first + shard_workers; i++) {
+		for (port = 0; port < CFG_MAX_PORTS; port++)
+			worker_slices[i].slices[port] = port_time_slice(port);
+	}
+}
+
+/*
+ * Whether run @run of worker @i may still be preempted: the worker allows it
+ * and this dispatcher did not preempt that run already.
+ */
+static inline bool worker_preemptible(uint8_t i, uint64_t run)
+{
+	return worker_status[i].check && dispatch_states[i].preempted_run != run;
+}
+
 static inline void preempt_worker(uint8_t i, uint64_t cur_time)
 {
-	uint64_t time_remaining = cur_time - preempt_check[i].timestamp;
-	if(likely(time_remaining < time_slice)) {
+	uint64_t run = worker_status[i].timestamp;
+	uint64_t time_remaining = cur_time - run;
+	if(likely(time_remaining < worker_time_slice(i))) {
 		epoch_slack = epoch_slack < time_remaining? epoch_slack : time_remaining;
 	}
 	else{
-		if (preempt_check[i].check)
+		if (worker_preemptible(i, run))
 		{
 			// Avoid preempting more times.
-			preempt_check[i].check = false;
-			dune_apic_send_posted_ipi(PREEMPT_VECTOR, CFG.cpu[i + 2]);
+			dispatch_states[i].preempted_run = run;
+			dune_apic_send_posted_ipi(PREEMPT_VECTOR, CFG.cpu[i + WORKER_CPU_BASE]);
 		}
 	}
 }
 
 static inline void concord_preempt_worker(uint8_t i, uint64_t cur_time)
 {
-	uint64_t time_remaining = cur_time - preempt_check[i].timestamp;
-	if(likely(time_remaining < time_slice)) {
+	uint64_t run = worker_status[i].timestamp;
+	uint64_t time_remaining = cur_time - run;
+	if(likely(time_remaining < worker_time_slice(i))) {
 		epoch_slack = epoch_slack < time_remaining? epoch_slack : time_remaining;
 	}
 	else{
-		if (preempt_check[i].check)
+		if (worker_preemptible(i, run))
 		{
 			// Avoid preempting more times.
 			*(cpu_preempt_points[i]) = 1;
-			preempt_check[i].check = false;
+			dispatch_states[i].preempted_run = run;
+#if PREEMPT_TRACE == 1
+			ptrace_flag_set(i, cur_time);
+#endif
 		}
 	}
 }
 
+#if SCHEDULE_METHOD == METHOD_RDTSC
+/* Workers preempt themselves; only the slack of the running ones is kept. */
+static inline void rdtsc_track_worker(uint8_t i, uint64_t cur_time)
+{
+	uint64_t time_remaining = cur_time - worker_status[i].timestamp;
+	if (time_remaining < worker_time_slice(i))
+		epoch_slack = epoch_slack < time_remaining? epoch_slack : time_remaining;
+}
+#endif
+
+#if SCHEDULE_METHOD == METHOD_HYBRID
+/*
+ * Per worker, when to fall back to an IPI (0 when not armed) and the start
+ * timestamp of the run it was armed for. Each dispatcher only touches the
+ * entries of its shard.
+ */
+static uint64_t ipi_deadlines[MAX_WORKERS];
+static uint64_t ipi_runs[MAX_WORKERS];
+static __thread uint64_t preempt_grace;
+
+/*
+ * IPIs sent to each worker, and how many of them the worker had still not
+ * taken preempt_grace cycles later, which happens when the request runs
+ * with interrupts masked.
+ */
+struct ipi_counts {
+	uint64_t sent;
+	uint64_t not_taken;
+	bool pending;           /* sent, not checked yet */
+};
+static struct ipi_counts ipi_counts[MAX_WORKERS];
+
+/**
+ * hybrid_preempt_worker - raises the Concord flag, then sends an IPI if needed
+ * @i: the worker
+ * @cur_time: the current timestamp
+ *
+ * The flag is consumed by the first probe the request runs. If it is still
+ * raised preempt_grace cycles later, the request is stuck in code without
+ * probes, such as libc or a third-party library, and gets a posted IPI.
+ */
+static inline void hybrid_preempt_worker(uint8_t i, uint64_t cur_time)
+{
+	uint64_t run = worker_status[i].timestamp;
+	uint64_t time_remaining = cur_time - run;
+	if(likely(time_remaining < worker_time_slice(i))) {
+		epoch_slack = epoch_slack < time_remaining? epoch_slack : time_remaining;
+	}
+	else if (worker_preemptible(i, run)) {
+		*(cpu_preempt_points[i]) = 1;
+		dispatch_states[i].preempted_run = run;
+		ipi_deadlines[i] = cur_time + preempt_grace;
+		ipi_runs[i] = run;
+		ipi_counts[i].pending = false;
+#if PREEMPT_TRACE == 1
+		ptrace_flag_set(i, cur_time);
+#endif
+	}
+	else if (ipi_deadlines[i] && cur_time >= ipi_deadlines[i]) {
+		ipi_deadlines[i] = 0;
+		if (!*(cpu_preempt_points[i]) || worker_status[i].timestamp != ipi_runs[i]) {
+			ipi_counts[i].pending = false;
+		} else if (ipi_counts[i].pending) {
+			/* The handler clears the flag; the request never took the IPI. */
+			ipi_counts[i].pending = false;
+			ipi_counts[i].not_taken++;
+		} else {
+			dune_apic_send_posted_ipi(PREEMPT_VECTOR, CFG.cpu[i + WORKER_CPU_BASE]);
+			ipi_counts[i].sent++;
+			ipi_counts[i].pending = true;
+			ipi_deadlines[i] = cur_time + preempt_grace;
+		}
+	}
+}
+#endif
+
 static inline void handle_worker(uint8_t i, uint64_t cur_time)
 {
 	#if (SCHEDULE_METHOD == METHOD_PI)
@@ -288,85 +608,205 @@ static inline void handle_worker(uint8_t i, uint64_t cur_time)
 	#if (SCHEDULE_METHOD == METHOD_CONCORD)
 	concord_preempt_worker(i, cur_time);
 	#endif
+	#if (SCHEDULE_METHOD == METHOD_HYBRID)
+	hybrid_preempt_worker(i, cur_time);
+	#endif
+	#if (SCHEDULE_METHOD == METHOD_RDTSC)
+	rdtsc_track_worker(i, cur_time);
+	#endif
+
+#if WORKER_STEALING == 1
+	handle_local_results(i);
+#else
+	uint8_t slot = dispatch_states[i].next_pop;
+	uint8_t flag = worker_status[i].flags[slot];
 
-	if (dispatcher_requests[i].requests[dispatch_states[i].next_pop].flag != READY)
+	if (flag == dispatch_states[i].taken[slot])
+		return;
+	dispatch_states[i].taken[slot] = flag;
+	flag = JBSQ_FLAG_STATE(flag);
+
+	if (flag == FINISHED)
 	{
-		if (worker_responses[i].responses[dispatch_states[i].next_pop].flag == FINISHED)
-		{
-			handle_finished(i, dispatch_states[i].next_pop);
-			jbsq_get_next(&(dispatch_states[i].next_pop));
-            dispatch_states[i].occupancy--;
-            if(dispatch_states[i].occupancy == 0){
-                idle_list_head--;
-                idle_list[idle_list_head] = i;
-            }
-		}
-		else if (worker_responses[i].responses[dispatch_states[i].next_pop].flag == PREEMPTED)
-		{
-			handle_preempted(i, dispatch_states[i].next_pop);
-			jbsq_get_next(&(dispatch_states[i].next_pop));
-			dispatch_states[i].occupancy--;
-            if(dispatch_states[i].occupancy == 0){
-                idle_list_head--;
-                idle_list[idle_list_head] = i;
-            }
-		}
-	} 
+		handle_finished(i, dispatch_states[i].next_pop);
+		jbsq_get_next(&(dispatch_states[i].next_pop));
+		set_occupancy(i, dispatch_states[i].occupancy - 1);
+	}
+	else if (flag == PREEMPTED)
+	{
+		handle_preempted(i, dispatch_states[i].next_pop);
+		jbsq_get_next(&(dispatch_states[i].next_pop));
+		set_occupancy(i, dispatch_states[i].occupancy - 1);
+	}
+#endif
 }
 
-static inline void handle_networker(uint64_t cur_time)
+/**
+ * handle_networker_rings - takes the requests of one networker
+ * @nr: the rings shared with that networker
+ * @n: its number
+ * @cur_time: the current timestamp
+ *
+ * Only requests that came from networker @n go back on its frees ring, so
+ * that each one is freed into the per-cpu mempools it was allocated from.
+ */
+static inline void handle_networker_rings(struct networker_rings * nr, int n,
+					  uint64_t cur_time)
 {
 	int i, ret;
-	uint8_t type;
+	uint32_t type;
+	struct request * req;
 	ucontext_t *cont;
 
-	if (networker_pointers.cnt != 0)
+	for (i = 0; i < HANDOFF_POP_BUDGET; i++)
 	{
-		for (i = 0; i < networker_pointers.cnt; i++)
+		if (!handoff_pop(&nr->reqs, &req, &type))
+			break;
+		if (unlikely(!sched_can_admit()))
 		{
-			if(unlikely(networker_pointers.reqs[i] == NULL))
-			{
-				continue;
-			}
-			dispatched_pkts++;
-			ret = context_alloc(&cont);
-			if (unlikely(ret))
-			{
-				log_warn("Cannot allocate context\n");
-				request_enqueue(&frqueue, networker_pointers.reqs[i]);
-                                continue;
-                        }
-                        type = networker_pointers.types[i];
-                        tskq_enqueue_tail(&tskq, cont,
-                                          networker_pointers.reqs[i],
-                                          type, PACKET, cur_time);
-                }
-
-                for (i = 0; i < ETH_RX_MAX_BATCH; i++) {
-                        struct request * req = request_dequeue(&frqueue);
-                        if (!req)
-                                break;
-                        networker_pointers.reqs[i] = req;
-			networker_pointers.free_cnt++;
+			dispatcher_stats[dispatcher_id].dropped_pkts++;
+			request_retire(req);
+			continue;
 		}
-		networker_pointers.cnt = 0;
+		ret = context_alloc(&cont, type, shard_node);
+		if (unlikely(ret))
+		{
+			log_warn("Cannot allocate context\n");
+			request_retire(req);
+			continue;
+		}
+		if (unlikely(sched_enqueue(cont, req, type, PACKET, cur_time)))
+		{
+			context_free(cont, type);
+			dispatcher_stats[dispatcher_id].dropped_pkts++;
+			request_retire(req);
+			continue;
+		}
+		dispatcher_stats[dispatcher_id].dispatched_pkts++;
+	}
+	handoff_release(&nr->reqs);
+
+	while ((req = request_dequeue(&frqueue[n]))) {
+		if (unlikely(!handoff_push(&nr->frees, req, 0))) {
+			request_enqueue(&frqueue[n], req);
+			break;
+		}
+	}
+	handoff_flush(&nr->frees);
+}
+
+/**
+ * handle_networker - takes the requests handed over by the networkers
+ * @cur_time: the current timestamp
+ *
+ * Every networker has its own rings, each visited once per loop and drained
+ * of at most HANDOFF_POP_BUDGET requests. The first networker visited moves
+ * each time, so none is favored when admission control starts dropping
+ * requests. Requests to free go back to the networker that allocated them.
+ */
+static inline void handle_networker(uint64_t cur_time)
+{
+#if NUM_NETWORKERS > 1
+	int i, n = next_networker;
+
+	for (i = 0; i < NUM_NETWORKERS; i++) {
+		handle_networker_rings(&networker_rings[n][dispatcher_id], n,
+				       cur_time);
+		n = n + 1 == NUM_NETWORKERS ? 0 : n + 1;
+	}
+	next_networker = next_networker + 1 == NUM_NETWORKERS ?
+			 0 : next_networker + 1;
+#else
+	handle_networker_rings(&networker_rings[0][dispatcher_id], 0, cur_time);
+#endif
+}
+
+#if NUM_DISPATCHERS > 1
+/**
+ * serve_steal_request - hands surplus tasks over to a dispatcher that ran dry
+ * @cur_time: the current timestamp
+ *
+ * Called after dispatch_requests(), so whatever is left in the task queue
+ * could not be placed on one of our own workers.
+ */
+static inline void serve_steal_request(uint64_t cur_time)
+{
+	uint8_t thief, cnt = 0;
+	void *rnbl;
+	struct request *req;
+	uint8_t type, category;
+	uint64_t timestamp;
+
+	thief = steal_requests[dispatcher_id].thief;
+	if (likely(!thief))
+		return;
+	thief--;
+
+	while (cnt < STEAL_BATCH) {
+		if (sched_dequeue(&rnbl, &req, &type, &category, &timestamp,
+				  cur_time))
+			break;
+		steal_batches[thief].rnbls[cnt] = rnbl;
+		steal_batches[thief].reqs[cnt] = req;
+		steal_batches[thief].types[cnt] = type;
+		steal_batches[thief].categories[cnt] = category;
+		steal_batches[thief].timestamps[cnt] = timestamp;
+		cnt++;
 	}
+	steal_batches[thief].cnt = cnt;
+	steal_batches[thief].ready = 1;
+	steal_requests[dispatcher_id].thief = 0;
 }
 
+/**
+ * steal_work - asks another dispatcher for work when our shard is starving
+ *
+ * At most one steal is outstanding at a time. Victims are probed round-robin.
+ */
+static inline void steal_work(void)
+{
+	uint8_t i, cnt;
+
+	if (steal_pending) {
+		if (!steal_batches[dispatcher_id].ready)
+			return;
+		cnt = steal_batches[dispatcher_id].cnt;
+		for (i = 0; i < cnt; i++)
+			sched_enqueue(steal_batches[dispatcher_id].rnbls[i],
+				      steal_batches[dispatcher_id].reqs[i],
+				      steal_batches[dispatcher_id].types[i],
+				      steal_batches[dispatcher_id].categories[i],
+				      steal_batches[dispatcher_id].timestamps[i]);
+		dispatcher_stats[dispatcher_id].stolen_tasks += cnt;
+		steal_batches[dispatcher_id].ready = 0;
+		steal_pending = false;
+		return;
+	}
+
+	if (!shard_has_idle_worker() || !sched_is_empty())
+		return;
+
+	steal_victim = (steal_victim + 1) % NUM_DISPATCHERS;
+	if (steal_victim == dispatcher_id)
+		steal_victim = (steal_victim + 1) % NUM_DISPATCHERS;
+
+	if (__sync_bool_compare_and_swap(&steal_requests[steal_victim].thief,
+					 0, dispatcher_id + 1))
+		steal_pending = true;
+}
+#endif
+
 /**
  * generic_work - generic function acting as placeholder for application-level
  *                work
- * @msw: the top 32-bits of the pointer containing the data
- * @lsw: the bottom 32 bits of the pointer containing the data
+ * @data: the request payload
+ * @id: the request's addresses and ports
  */
-static void dispatcher_generic_work(uint32_t msw, uint32_t lsw, uint32_t msw_id,
-                         uint32_t lsw_id)
+static void dispatcher_generic_work(void *data, struct ip_tuple *id)
 {
     asm volatile("sti" ::
                      :);
 
-    struct ip_tuple *id = (struct ip_tuple *)((uint64_t)msw_id << 32 | lsw_id);
-    void *data = (void *)((uint64_t)msw << 32 | lsw);
     int ret;
 
     struct message * req = (struct message *) data;
@@ -390,6 +830,8 @@ static void dispatcher_generic_work(uint32_t msw, uint32_t lsw, uint32_t msw_id,
     {
         asm volatile("nop");
         i++;
+        if (!(i & 0xff))
+            dispatcher_probe();
     } while (i / 0.233 < req->runNs);
 
          
@@ -489,6 +931,8 @@ static void dispatcher_do_db_generic_work(struct db_req *db_pkg, uint64_t start_
             asm volatile("nop");
             asm volatile("nop");
             k++;
+            if (!(k & 0xff))
+                dispatcher_probe();
         }
 
         break;
@@ -539,6 +983,7 @@ static void dispatcher_do_db_generic_work(struct db_req *db_pkg, uint64_t start_
 static inline void dispatcher_handle_new_packet(void)
 {
     int ret;
+    uintptr_t *sp;
     void *data;
     struct ip_tuple *id;
     struct mbuf *pkt = (struct mbuf *)dispatcher_job.req;
@@ -546,17 +991,11 @@ static inline void dispatcher_handle_new_packet(void)
 
     if (data)
     {
-        uint32_t msw = ((uint64_t)data & 0xFFFFFFFF00000000) >> 32;
-        uint32_t lsw = (uint64_t)data & 0x00000000FFFFFFFF;
-        uint32_t msw_id = ((uint64_t)id & 0xFFFFFFFF00000000) >> 32;
-        uint32_t lsw_id = (uint64_t)id & 0x00000000FFFFFFFF;
-
-        dispatcher_cont = (struct mbuf *) dispatcher_job.rnbl;
-        getcontext_fast(dispatcher_cont);
-        set_context_link(dispatcher_cont, &dispatcher_uctx_main);
-        makecontext(dispatcher_cont, (void (*)(void))dispatcher_generic_work, 4, msw, lsw,
-                    msw_id, lsw_id);
-        ret = swapcontext_very_fast(&dispatcher_uctx_main, dispatcher_cont);
+        dispatcher_cont = dispatcher_job.rnbl;
+        sp = context_frame(dispatcher_cont, &dispatcher_uctx_main);
+        ret = context_start_fast(&dispatcher_uctx_main, sp,
+                                 (void (*)(void))dispatcher_generic_work,
+                                 (uint64_t)data, (uint64_t)id);
         if (ret)
         {
             log_err("Failed to do swap into new context\n");
@@ -573,6 +1012,7 @@ static inline void dispatcher_handle_new_packet(void)
 static inline void dispatcher_handle_fake_new_packet(void)
 {
     int ret;
+    uintptr_t *sp;
     struct mbuf *pkt;
     struct db_req *req;
 
@@ -588,12 +1028,12 @@ static inline void dispatcher_handle_fake_new_packet(void)
         return;
     }
 
-    dispatcher_cont = (struct mbuf *) dispatcher_job.rnbl;
-    getcontext_fast(dispatcher_cont);
-    set_context_link(dispatcher_cont, &dispatcher_uctx_main);
+    dispatcher_cont = dispatcher_job.rnbl;
+    sp = context_frame(dispatcher_cont, &dispatcher_uctx_main);
 
-    makecontext(dispatcher_cont, (void (*)(void))dispatcher_do_db_generic_work, 2, req, dispatcher_job.timestamp);
-    ret = swapcontext_very_fast(&dispatcher_uctx_main, dispatcher_cont);
+    ret = context_start_fast(&dispatcher_uctx_main, sp,
+                             (void (*)(void))dispatcher_do_db_generic_work,
+                             (uint64_t)req, dispatcher_job.timestamp);
     if (ret)
     {
         log_err("Failed to do swap into new context\n");
@@ -606,7 +1046,7 @@ static inline void dispatcher_handle_context(void)
     int ret;
 	dispatcher_cont = dispatcher_job.rnbl;
     set_context_link(dispatcher_cont, &dispatcher_uctx_main);
-    ret = swapcontext_very_fast(&dispatcher_uctx_main, dispatcher_cont);
+    ret = swapcontext_fast(&dispatcher_uctx_main, dispatcher_cont);
     if (ret)
     {
         log_err("Failed to swap to existing context\n");
@@ -620,14 +1060,28 @@ static inline void dispatcher_finish_request(void)
 	if(dispatcher_job_status == COMPLETED){
 		if (dispatcher_job.req == NULL)
 			log_warn("No mbuf was returned from worker\n");
-		context_free(dispatcher_job.rnbl);
-                request_enqueue(&frqueue, (struct request *) dispatcher_job.req);
+		context_free(dispatcher_job.rnbl, dispatcher_job.type);
+		request_retire((struct request *) dispatcher_job.req);
+		dispatcher_stats[dispatcher_id].self_completions++;
 	}
 	else{
 		dispatcher_job.category = CONTEXT;
+		dispatcher_stats[dispatcher_id].self_preemptions++;
 	}
 }
 
+/*
+ * Lets the dispatcher's own request run until the busy workers may need
+ * attention, and never longer than dispatcher_work_bound, so new requests and
+ * preemptions are never held back by more than that.
+ */
+static inline void dispatcher_arm_job(void)
+{
+    concord_start_time = rdtsc();
+    concord_preempt_after_cycle = epoch_slack < dispatcher_work_bound ?
+                                  epoch_slack : dispatcher_work_bound;
+}
+
 static inline void dispatcher_handle_fake_request(uint64_t cur_time)
 {
 	if(dispatcher_job_status != ONGOING) {
@@ -635,7 +1089,7 @@ static inline void dispatcher_handle_fake_request(uint64_t cur_time)
                 struct request* req;
 		uint8_t type, category;
 		uint64_t timestamp;
-		if(tskq_dequeue_category(&tskq, &rnbl, &req, &type,&category, &timestamp, PACKET))
+		if(sched_dequeue_category(&rnbl, &req, &type, &category, &timestamp, cur_time, PACKET))
 			return;
 		dispatcher_job.rnbl = rnbl;
 		dispatcher_job.req = req;
@@ -645,8 +1099,7 @@ static inline void dispatcher_handle_fake_request(uint64_t cur_time)
 		dispatcher_job_status = ONGOING;
 	}
 
-    concord_start_time = rdtsc();
-    concord_preempt_after_cycle = epoch_slack;
+    dispatcher_arm_job();
 
     if (dispatcher_job.category == PACKET)
     {
@@ -660,7 +1113,7 @@ static inline void dispatcher_handle_fake_request(uint64_t cur_time)
 	dispatcher_finish_request();
 }
 
-static inline void dispatcher_handle_request(void)
+static inline void dispatcher_handle_request(uint64_t cur_time)
 {
 
    if(dispatcher_job_status != ONGOING) {
@@ -668,7 +1121,7 @@ static inline void dispatcher_handle_request(void)
       struct request* req;
       uint8_t type, category;
       uint64_t timestamp;
-      if(tskq_dequeue_category(&tskq, &rnbl, &req, &type,&category, &timestamp, PACKET))
+      if(sched_dequeue_category(&rnbl, &req, &type, &category, &timestamp, cur_time, PACKET))
            return;
       dispatcher_job.rnbl = rnbl;
       dispatcher_job.req = req;
@@ -678,8 +1131,7 @@ static inline void dispatcher_handle_request(void)
       dispatcher_job_status = ONGOING;
    }
 
-    concord_start_time = rdtsc();
-    concord_preempt_after_cycle = epoch_slack;
+    dispatcher_arm_job();
 
     if (dispatcher_job.category == PACKET)
     {
@@ -700,26 +1152,173 @@ void dispatcher_do_work(uint64_t cur_time){
 
         eth_process_reclaim();
         eth_process_send();
-        dispatcher_handle_request();
+        dispatcher_handle_request(cur_time);
 #endif
 }
 
+/**
+ * dispatcher_init_shard - assigns a contiguous range of workers to a dispatcher
+ * @id: the dispatcher number
+ * @num_cpus: the total number of cpus in use
+ */
+static void dispatcher_init_shard(uint8_t id, int num_cpus)
+{
+	int i, node, count[STACK_MAX_NODES] = {0};
+
+	dispatcher_id = id;
+	if (sched_init())
+		panic("Dispatcher %d: cannot allocate task queue\n", id);
+	num_workers = num_cpus - WORKER_CPU_BASE;
+	shard_first = id * num_workers / NUM_DISPATCHERS;
+	shard_workers = (id + 1) * num_workers / NUM_DISPATCHERS - shard_first;
+	steal_victim = id;
+#if SCHEDULE_METHOD == METHOD_HYBRID
+	preempt_grace = CFG.preempt_grace * CPU_FREQ_GHZ;
+#endif
+	for (i = shard_first; i < shard_first + shard_workers; i++)
+		count[worker_node(i)]++;
+	for (node = 0; node < STACK_MAX_NODES; node++) {
+		if (count[node] > count[shard_node])
+			shard_node = node;
+	}
+	dispatcher_stats[id].quantum_ns = time_slice / CPU_FREQ_GHZ;
+	for (int t = 0; t < CFG.num_quanta; t++)
+		type_slices[t] = CFG.quanta[t] ? CFG.quanta[t] * CPU_FREQ_GHZ : MAX_UINT64;
+	publish_time_slices();
+
+	dispatch_states_init();
+	requests_init();
+#if DISPATCHER_DO_WORK == 1
+	dispatcher_dl_init();
+#endif
+	log_info("Dispatcher %d serving workers %d-%d\n", id, shard_first,
+		 shard_first + shard_workers - 1);
+}
+
+#if ADAPTIVE_QUANTUM == 1
+/**
+ * adapt_time_slice - periodically retunes this shard's preemption time slice
+ * @cur_time: the current timestamp
+ */
+static inline void adapt_time_slice(uint64_t cur_time)
+{
+	uint64_t quantum;
+
+	if (likely(cur_time < next_retune))
+		return;
+	next_retune = cur_time + QUANTUM_EPOCH_US * 1000 * CPU_FREQ_GHZ;
+
+	quantum = quantum_retune(dispatcher_stats[dispatcher_id].quantum_ns);
+	if (quantum == dispatcher_stats[dispatcher_id].quantum_ns)
+		return;
+	log_debug("Dispatcher %d: time slice %llu -> %llu ns\n", dispatcher_id,
+		  dispatcher_stats[dispatcher_id].quantum_ns, quantum);
+	dispatcher_stats[dispatcher_id].quantum_ns = quantum;
+	time_slice = quantum * CPU_FREQ_GHZ;
+	dispatcher_work_thresh = time_slice / 10;
+	publish_time_slices();
+}
+#endif
+
+/**
+ * dispatch_once - one iteration of the dispatcher loop for this shard
+ * @cur_time: the current timestamp
+ */
+static inline void dispatch_once(uint64_t cur_time)
+{
+	uint8_t i;
+#if DISPATCHER_CYCLE_STATS == 1
+	uint64_t placed = dispatcher_stats[dispatcher_id].placed_tasks;
+#endif
+
+#if ADAPTIVE_QUANTUM == 1
+	adapt_time_slice(cur_time);
+#endif
+	epoch_slack = time_slice;
+	for (i = shard_first; i < shard_first + shard_workers; i++){
+		if (i + 1 < shard_first + shard_workers)
+			prefetch0((const void *) &worker_status[i + 1]);
+		handle_worker(i, cur_time);
+	}
+#if DISPATCHER_CYCLE_STATS == 1
+	dispatcher_stats[dispatcher_id].loops++;
+#endif
+	handle_networker(cur_time);
+#if WORKER_STEALING == 1
+	fill_local_deques(cur_time);
+#else
+	dispatch_requests(cur_time);
+#endif
+#if NUM_DISPATCHERS > 1
+	serve_steal_request(cur_time);
+	steal_work();
+#endif
+#if DISPATCHER_DO_WORK == 1
+	if(epoch_slack > dispatcher_work_thresh){
+		epoch_slack-= dispatcher_work_thresh;
+		dispatcher_do_work(cur_time);
+	}
+#endif
+#if DISPATCHER_CYCLE_STATS == 1
+	if (dispatcher_stats[dispatcher_id].placed_tasks != placed)
+		dispatcher_stats[dispatcher_id].busy_cycles += rdtsc() - cur_time;
+#endif
+}
+
+#if HANDOFF_STATS == 1
+/**
+ * print_handoff_stats - reports the throughput and latency of every ring
+ * @elapsed_us: the length of the run
+ */
+static void print_handoff_stats(uint64_t elapsed_us)
+{
+	int n, d;
+	struct handoff_ring *r;
+
+	for (n = 0; n < NUM_NETWORKERS; n++) {
+		for (d = 0; d < NUM_DISPATCHERS; d++) {
+			r = &networker_rings[n][d].reqs;
+			if (!r->cons.popped)
+				continue;
+			log_info("Handoff %d->%d - ring %d, requests %llu, rate %llu KRps, full %llu, "
+				 "latency (cycles) mean %llu p50 <%llu p99 <%llu max %llu\n",
+				 n, d, HANDOFF_RING_LEN, r->cons.popped,
+				 r->cons.popped * 1000 / elapsed_us, r->prod.full,
+				 r->cons.lat_cycles / r->cons.popped,
+				 handoff_lat_pct(r, 50), handoff_lat_pct(r, 99),
+				 r->cons.lat_max);
+		}
+	}
+}
+#endif
+
+/**
+ * do_dispatching_shard - main loop of the additional dispatcher cores
+ * @id: the dispatcher number, between 1 and NUM_DISPATCHERS - 1
+ * @num_cpus: the total number of cpus in use
+ */
+void do_dispatching_shard(int id, int num_cpus)
+{
+	dispatcher_work_thresh = time_slice/10;
+
+	while (!INIT_FINISHED);
+
+	dispatcher_init_shard(id, num_cpus);
+	while (1)
+		dispatch_once(rdtsc());
+}
+
 /**
  * do_dispatching - implements dispatcher core's main loop
  */
 void do_dispatching(int num_cpus)
 {
-	uint8_t i;
 	uint64_t cur_time;
 	dispatcher_work_thresh = time_slice/10;
 
 	while (!INIT_FINISHED);
 	
-	num_workers = num_cpus-2;
-	preempt_check_init();
-	dispatch_states_init();
-	requests_init();
-	dispatcher_dl_init();
+	dispatcher_init_shard(0, num_cpus);
 	bool flag = true;
 	while (1)
 	{
@@ -730,9 +1329,53 @@ void do_dispatching(int num_cpus)
 			log_info("Benchmark - Total number of packets %d \n", TEST_TOTAL_PACKETS_COUNTER);
 			log_info("Benchmark - %d DB_GET, %d DB_ITERATOR, %d DB_PUT, %d DB_DELETE, %d DB_SEEK\n", TEST_RCVD_DB_GET, TEST_RCVD_DB_ITERATOR, TEST_RCVD_DB_PUT, TEST_RCVD_DB_DELETE, TEST_RCVD_DB_SEEK);
 			log_info("Benchmark - Time elapsed (us): %llu\n",  TEST_END_TIME- TEST_START_TIME);
+			uint64_t dispatched_pkts = 0;
+			for (int d = 0; d < NUM_DISPATCHERS; d++) {
+				log_info("Dispatcher %d - dispatched pkts %llu, stolen tasks %llu, dropped pkts %llu\n", d,
+					 dispatcher_stats[d].dispatched_pkts, dispatcher_stats[d].stolen_tasks,
+					 dispatcher_stats[d].dropped_pkts);
+#if DISPATCHER_CYCLE_STATS == 1
+				if (dispatcher_stats[d].placed_tasks)
+					log_info("Dispatcher %d - cycles per placed task: %llu\n", d,
+						 dispatcher_stats[d].busy_cycles / dispatcher_stats[d].placed_tasks);
+				log_info("Dispatcher %d - loops: %llu\n", d, dispatcher_stats[d].loops);
+#endif
+#if DISPATCHER_DO_WORK == 1
+				log_info("Dispatcher %d - ran itself %llu requests, preempted %llu times\n", d,
+					 dispatcher_stats[d].self_completions,
+					 dispatcher_stats[d].self_preemptions);
+#endif
+				log_info("Dispatcher %d - time slice %llu ns, completions %llu, preemptions %llu, preemption rate %llu/s\n", d,
+					 dispatcher_stats[d].quantum_ns, dispatcher_stats[d].completions,
+					 dispatcher_stats[d].preemptions,
+					 dispatcher_stats[d].preemptions * 1000000 / (TEST_END_TIME - TEST_START_TIME));
+				dispatched_pkts += dispatcher_stats[d].dispatched_pkts;
+			}
+			for (int w = 0; w < num_workers; w++) {
+				if (preempt_counts[w].probe || preempt_counts[w].ipi)
+					log_info("Worker %d - preempted at a probe %llu, by IPI %llu\n", w,
+						 preempt_counts[w].probe, preempt_counts[w].ipi);
+#if SCHEDULE_METHOD == METHOD_HYBRID
+				if (ipi_counts[w].not_taken)
+					log_warn("Worker %d - %llu of %llu IPIs not taken within the grace period, interrupts masked in request code?\n", w,
+						 ipi_counts[w].not_taken, ipi_counts[w].sent);
+#endif
+				if (tx_stats[w].responses)
+					log_info("Worker %d - responses %llu in %llu doorbells, TX cycles per response %llu (%llu building, %llu transmitting)\n", w,
+						 tx_stats[w].responses, tx_stats[w].doorbells,
+						 (tx_stats[w].send_cycles + tx_stats[w].flush_cycles) / tx_stats[w].responses,
+						 tx_stats[w].send_cycles / tx_stats[w].responses,
+						 tx_stats[w].flush_cycles / tx_stats[w].responses);
+			}
 			uint64_t rate =  dispatched_pkts*1000/(TEST_END_TIME- TEST_START_TIME);
 			log_info("Dispatched pkts, rate: %llu : %llu KRps\n", dispatched_pkts,rate);
+#if HANDOFF_STATS == 1
+			print_handoff_stats(TEST_END_TIME - TEST_START_TIME);
+#endif
 			print_stats();
+#if PREEMPT_TRACE == 1
+			ptrace_dump(num_workers);
+#endif
 			for(int i = 0; i <DISPATCHER_STATS_ITERATOR_LIMIT; i++){
 				if(dispatcher_timestamps[i].start)
 					log_info("Dispatching latency: %llu\n", dispatcher_timestamps[i].end-dispatcher_timestamps[i].start);
@@ -746,18 +1389,7 @@ void do_dispatching(int num_cpus)
 
 		// Turn on to measure dispatching latencies
 		// dispatcher_timestamps[dispatcher_timestamp_iterator].start = cur_time;
-		epoch_slack = PREEMPTION_DELAY;
-		for (i = 0; i < num_cpus - 2; i++){
-			handle_worker(i, cur_time);
-		}
-		handle_networker(cur_time);
-		dispatch_requests(cur_time);
-	#if DISPATCHER_DO_WORK == 1
-		if(epoch_slack > dispatcher_work_thresh){
-			epoch_slack-= dispatcher_work_thresh;
-			dispatcher_do_work(cur_time);
-		}
-	#endif
+		dispatch_once(cur_time);
 
 		// Turn on to measure dispatching latencies
 		// dispatcher_timestamps[dispatcher_timestamp_iterator].end = rdtsc();
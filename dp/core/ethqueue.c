@@ -44,6 +44,9 @@
 
 DEFINE_PERCPU(int, eth_num_queues);
 DEFINE_PERCPU(struct eth_tx_queue *, eth_txqs[NETHDEV]);
+DEFINE_PERCPU(struct eth_rx_queue *, eth_rxqs[NETHDEV]);
+DEFINE_PERCPU(struct mbuf *, recv_mbufs[ETH_RX_MAX_BATCH]);
+DEFINE_PERCPU(int, recv_type[ETH_RX_MAX_BATCH]);
 
 struct myresponse
 {
@@ -115,7 +118,7 @@ bool eth_rx_idle_wait(uint64_t usecs)
 	start = rdtsc();
 	do {
 		for (i = 0; i < percpu_get(eth_num_queues); i++) {
-			rxq = eth_rxqs[i];
+			rxq = percpu_get(eth_rxqs[i]);
 			if(rxq->ready(rxq))
 				return true;
 		}
@@ -11,7 +11,7 @@
 #include <math.h>
 #include <time.h>
 
-#if SCHEDULE_METHOD == METHOD_PI
+#if SCHEDULE_METHOD == METHOD_PI || SCHEDULE_METHOD == METHOD_HYBRID
 #define PRE_PROTECTCALL { asm volatile ("cli" :::); }
 #define POST_PROTECTCALL { asm volatile ("sti" :::); }
 #else 
@@ -47,6 +47,7 @@
 #include <ix/drivers.h>
 #include <ix/context.h>
 #include <ix/dispatch.h>
+#include <ix/stack.h>
 
 // Added for leveldb
 #include <ix/leveldb.h>
@@ -91,21 +92,21 @@ extern int mempool_init(void);
 extern int init_migration_cpu(void);
 extern int dpdk_init(void);
 extern int taskqueue_init(void);
+extern int taskqueue_init_cpu(void);
 extern int request_init(void);
+extern int request_init_cpu(void);
 extern int response_init(void);
 extern int response_init_cpu(void);
 extern int context_init(void);
+extern int context_init_cpu(void);
+extern int wrap_init(void);
 extern void do_work(void);
-extern void do_networking(void);
-extern void do_fake_networking(int num_cpus);
+extern void do_networking(int id);
+extern void do_fake_networking(int id, int num_cpus);
 extern void do_dispatching(int num_cpus);
+extern void do_dispatching_shard(int dispatcher_id, int num_cpus);
 
-extern struct mempool context_pool;
-extern struct mempool stack_pool;
-pthread_t tid[MAX_WORKERS];
-
-// Flag that controls whether interrupts are disabled during memory allocation.
-uint8_t flag;
+pthread_t tid[MAX_WORKERS + NUM_DISPATCHERS + NUM_NETWORKERS];
 
 volatile bool INIT_FINISHED = false;
 
@@ -126,10 +127,11 @@ static struct init_vector_t init_tbl[] = {
 	{ "dpdk",    dpdk_init,    NULL, NULL},
 	{ "firstcpu", init_firstcpu, NULL, NULL},             // after cfg
 	{ "mbuf",    mbuf_init,    mbuf_init_cpu, NULL},      // after firstcpu
-	{ "taskqueue", taskqueue_init, NULL, NULL},      // after firstcpu
-	{ "request", request_init, NULL, NULL},  // after firstcpu
+	{ "taskqueue", taskqueue_init, taskqueue_init_cpu, NULL},      // after firstcpu
+	{ "request", request_init, request_init_cpu, NULL},  // after firstcpu
 	{ "response", response_init, response_init_cpu, NULL},
-	{ "context", context_init, NULL},
+	{ "context", context_init, context_init_cpu, NULL},
+	{ "malloc",  wrap_init,    NULL, NULL},              // after firstcpu
         { "ethdev", init_ethdev, NULL, NULL},
         { "tx_queue", NULL, init_tx_queues, NULL},
 	{ "hw",      init_hw,      NULL, NULL},               // spaws per-cpu init sequence
@@ -165,6 +167,10 @@ pgflt_handler(uintptr_t addr, uint64_t fec, struct dune_tf *tf)
 		       " at addr %lx, fec %lx\n", addr, fec);
 		dune_dump_trap_frame(tf);
 		dune_ret_from_user(-EFAULT);
+	} else if (stack_is_guard(addr)) {
+		log_err("init: stack overflow at addr %lx\n", addr);
+		dune_dump_trap_frame(tf);
+		panic("request stack overflow\n");
 	} else {
 		ret = dune_vm_lookup(pgroot, (void *) addr,
 				     CREATE_NORMAL, &pte);
@@ -252,7 +258,7 @@ static int init_rx_queue(void)
 	ret = 0;
 	for (i = 0; i < eth_dev_count; i++) {
 		struct ix_rte_eth_dev *eth = eth_dev[i];
-		ret = eth_dev_get_rx_queue(eth, &eth_rxqs[i]);
+		ret = eth_dev_get_rx_queue(eth, &percpu_get(eth_rxqs[i]));
 		if (ret) {
 			return ret;
 		}
@@ -278,11 +284,22 @@ static int init_network_cpu(void)
 		}
         }
 
-        networker_pointers.cnt = 0;
-
 	return 0;
 }
 
+/**
+ * networker_of_cpu - the networker number a CPU runs, or -1 if none
+ * @cpu_nr_: the index of the CPU in CFG.cpu
+ */
+static int networker_of_cpu(unsigned int cpu_nr_)
+{
+	if (cpu_nr_ == 1)
+		return 0;
+	if (cpu_nr_ >= NETWORKER_CPU_BASE && cpu_nr_ < WORKER_CPU_BASE)
+		return cpu_nr_ - NETWORKER_CPU_BASE + 1;
+	return -1;
+}
+
 /**
  * init_create_cpu - initializes a CPU
  * @cpu: the CPU number
@@ -323,7 +340,7 @@ static volatile int started_cpus;
 
 void *start_cpu(void *arg)
 {
-	int ret;
+	int ret, networker;
 	unsigned int cpu_nr_ = (unsigned int)(unsigned long) arg;
 	unsigned int cpu = CFG.cpu[cpu_nr_];
 
@@ -338,7 +355,8 @@ void *start_cpu(void *arg)
 	percpu_get(cpu_nr) = cpu_nr_;
 
 	log_info("start_cpu: starting cpu-specific work\n");
-	if (cpu_nr_ == 1) {
+	networker = networker_of_cpu(cpu_nr_);
+	if (networker >= 0) {
 		ret = init_rx_queue();
 		if (ret) {
 						log_err("init: failed to initialize RX queue\n");
@@ -347,24 +365,31 @@ void *start_cpu(void *arg)
 
 		started_cpus++;
 
-		// Wait until all TX queues are set up before starting ethernet
-		// device.
-		while (started_cpus != CFG.num_cpus - 1);
+		// Wait until all TX and RX queues are set up before starting
+		// ethernet device. RSS spreads over the RX queues set up by then.
+		if (networker == 0) {
+			while (started_cpus != CFG.num_cpus - 1);
 
-		ret = init_network_cpu();
-		if (ret) {
+			ret = init_network_cpu();
+			if (ret) {
 						log_err("init: failed to initialize network cpu\n");
 						exit(ret);
+			}
 		}
 		pthread_barrier_wait(&start_barrier);
 		
 #ifndef FAKE_WORK
-		do_networking();
+		do_networking(networker);
 #else
 		// generate_fake_requests_throughput();
-		do_fake_networking(CFG.num_cpus);
+		do_fake_networking(networker, CFG.num_cpus);
 #endif
 
+	} else if (cpu_nr_ < NETWORKER_CPU_BASE) {
+		started_cpus++;
+		pthread_barrier_wait(&start_barrier);
+		do_dispatching_shard(cpu_nr_ - DISPATCHER_CPU_BASE + 1,
+				     CFG.num_cpus);
 	} else {
 		started_cpus++;
 		pthread_barrier_wait(&start_barrier);
@@ -377,6 +402,13 @@ void *start_cpu(void *arg)
 static int init_hw(void)
 {
 	int i, ret = 0;
+
+	if (CFG.num_cpus < WORKER_CPU_BASE + NUM_DISPATCHERS) {
+		log_err("init: %d dispatchers need at least %d cpus\n",
+			NUM_DISPATCHERS, WORKER_CPU_BASE + NUM_DISPATCHERS);
+		return -EINVAL;
+	}
+
 	// will spawn per-cpu initialization sequence on CPU0
 	ret = init_create_cpu(CFG.cpu[0], 1);
 	if (ret) {
@@ -480,8 +512,6 @@ int main(int argc, char *argv[])
 	prepare_simple_db(db, DB_NUM_KEYS, woptions);
 	check_db_sequential(db, DB_NUM_KEYS,roptions);
 
-	flag = 1;
-
 	log_info("Init Leveldb - with prefilled random key-values\n");
 	uint64_t start_time = get_us();
 	while(get_us() - start_time < 2*1000000);
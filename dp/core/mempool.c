@@ -194,6 +194,20 @@ int mempool_init_buf_with_pages(struct mempool_datastore *mds, int elems_per_pag
  */
 
 int mempool_create_datastore(struct mempool_datastore *mds, int nr_elems, size_t elem_len, int nostraddle, int chunk_size, const char *name)
+{
+	return mempool_create_datastore_on_node(mds, nr_elems, elem_len, nostraddle,
+						chunk_size, name, -1);
+}
+
+/**
+ * mempool_create_datastore_on_node - initializes a memory pool datastore on a NUMA node
+ * @numa_node: the node to allocate the elements on, or -1 for the caller's
+ *
+ * The other parameters are those of mempool_create_datastore().
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int mempool_create_datastore_on_node(struct mempool_datastore *mds, int nr_elems, size_t elem_len, int nostraddle, int chunk_size, const char *name, int numa_node)
 {
 	int nr_pages;
 
@@ -212,12 +226,18 @@ int mempool_create_datastore(struct mempool_datastore *mds, int nr_elems, size_t
 	if (nostraddle) {
 		int elems_per_page = PGSIZE_2MB / elem_len;
 		nr_pages = div_up(nr_elems, elems_per_page);
-		mds->buf = page_alloc_contig(nr_pages);
+		if (numa_node < 0)
+			mds->buf = page_alloc_contig(nr_pages);
+		else
+			mds->buf = page_alloc_contig_on_node(nr_pages, numa_node);
 		assert(mds->buf);
 	} else {
 		nr_pages = PGN_2MB(nr_elems * elem_len + PGMASK_2MB);
 		nr_elems = nr_pages * PGSIZE_2MB / elem_len;
-		mds->buf = mem_alloc_pages(nr_pages, PGSIZE_2MB, NULL, MPOL_PREFERRED);
+		if (numa_node < 0)
+			mds->buf = mem_alloc_pages(nr_pages, PGSIZE_2MB, NULL, MPOL_PREFERRED);
+		else
+			mds->buf = mem_alloc_pages_onnode(nr_pages, PGSIZE_2MB, numa_node, MPOL_PREFERRED);
 	}
 
 	mds->nr_pages = nr_pages;
@@ -23,8 +23,12 @@
 /*
  * networker.c - networking core functionality
  *
- * A single core is responsible for receiving all network packets in the
- * system and forwading them to the dispatcher.
+ * NUM_NETWORKERS cores receive the network packets and forward them to the
+ * dispatchers. Each owns one RX queue per device, fed by the NIC's RSS, and
+ * a pair of handoff rings per dispatcher, so networkers never share state.
+ * RX goes on while a dispatcher is busy, until its ring fills up. All the
+ * packets of a request come from the same client flow and so reach the same
+ * networker, which reassembles them.
  */
 #include <stdio.h>
 
@@ -56,64 +60,119 @@ volatile bool TEST_STARTED = false;
 #else
 	double load_level = 0;
 #endif
+/* Share of the load generated by this networker. */
+static __thread double networker_load;
 
 struct custom_payload* generate_benchmark_request(struct mbuf* temp, uint64_t t);
 struct db_req* generate_db_req(struct request * req);
 
+static __thread int networker_id;
+static __thread int next_dispatcher;
+/* Requests still missing packets, only ever seen by this networker. */
+static __thread struct request_queue rqueue;
+
+/**
+ * networker_free_requests - frees the requests the dispatchers handed back
+ */
+static void networker_free_requests(void)
+{
+	int d;
+	uint32_t type;
+	struct request * req;
+	struct handoff_ring * r;
+
+	for (d = 0; d < NUM_DISPATCHERS; d++) {
+		r = &networker_rings[networker_id][d].frees;
+		while (handoff_pop(r, &req, &type))
+			request_free(req);
+		handoff_release(r);
+	}
+}
+
+/**
+ * networker_push - hands a request over to the dispatcher of the current burst
+ * @req: the request
+ * @type: its type
+ *
+ * When that dispatcher's ring is full the next ones are tried, and the
+ * networker only waits when all of them are.
+ */
+static void networker_push(struct request * req, uint32_t type)
+{
+	struct handoff_ring * r;
+
+	req->networker = networker_id;
+	while (1) {
+		r = &networker_rings[networker_id][next_dispatcher].reqs;
+		if (likely(handoff_push(r, req, type)))
+			return;
+		handoff_flush(r);
+		next_dispatcher = (next_dispatcher + 1) % NUM_DISPATCHERS;
+		networker_free_requests();
+	}
+}
+
+/**
+ * networker_end_burst - publishes the requests of a burst
+ *
+ * Dispatchers are visited round-robin, one burst each, so that every shard
+ * gets a fair share of the incoming requests.
+ */
+static void networker_end_burst(void)
+{
+	handoff_flush(&networker_rings[networker_id][next_dispatcher].reqs);
+	next_dispatcher = (next_dispatcher + 1) % NUM_DISPATCHERS;
+}
+
 /**
  * do_networking - implements networking core's functionality
+ * @id: the networker number, between 0 and NUM_NETWORKERS - 1
  */
-void do_networking(void)
+void do_networking(int id)
 {
-	log_info("Do networking started \n");
-	int i,j, num_recv;
-	rqueue.head = NULL;
+	log_info("Do networking %d started \n", id);
+	int i, num_recv;
+	struct mbuf ** mbufs = percpu_get(recv_mbufs);
+	networker_id = id;
+	next_dispatcher = id % NUM_DISPATCHERS;
 	while (1)
 	{
+		networker_free_requests();
+		timer_run();
 		eth_process_poll();
 		num_recv = eth_process_recv();
 		if (num_recv == 0)
 			continue;
-		while (networker_pointers.cnt != 0);
-		for (i = 0; i < networker_pointers.free_cnt; i++)
-		{
-			struct request * req = networker_pointers.reqs[i];
-			for (j = 0; j < req->pkts_length; j++) {
-				mbuf_free(req->mbufs[j]);
-			}
-			mempool_free(&request_mempool, req);
-		}
-		networker_pointers.free_cnt = 0;
-		j = 0;
         for (i = 0; i < num_recv; i++) {
-			struct request * req = rq_update(&rqueue, recv_mbufs[i]);
-			if (req) {
-				networker_pointers.reqs[j] = req;
-				networker_pointers.types[j] = (uint8_t) req->type;
-				j++;
-			}
+			struct request * req = rq_update(&rqueue, mbufs[i]);
+			if (req)
+				networker_push(req, req->type);
         }
-        networker_pointers.cnt = j;
+        networker_end_burst();
 	}
 }
 
 /**
  * do_fake_networking - implements fake network logic with a given benchmark
+ * @id: the networker number, between 0 and NUM_NETWORKERS - 1
+ * @num_cpus: the total number of cpus in use
  */
-void do_fake_networking(int num_cpus)
+void do_fake_networking(int id, int num_cpus)
 {
-	// Adjust the load level depending on the number of CPUs.
-	load_level = load_level * (num_cpus-2);
+	// Adjust the load level depending on the number of CPUs, and split it
+	// between the networkers.
+	networker_load = load_level * (num_cpus - WORKER_CPU_BASE) / NUM_NETWORKERS;
+	networker_id = id;
+	next_dispatcher = id % NUM_DISPATCHERS;
 
 	srand(time(NULL));
 	TEST_STARTED = true;
 	log_info("Generating fake work\n");
-	assert(load_level && "No load level passed, exiting");
-	log_info("Load level:  %f\n", load_level);
+	assert(networker_load && "No load level passed, exiting");
+	log_info("Load level:  %f\n", networker_load);
 	log_info("Test started\n");
 
-	uint64_t i, j, total_packet = 0;
-	rqueue.head = NULL;
+	uint64_t total_packet = 0;
 	while (!INIT_FINISHED);
 	
 	while (true)
@@ -125,16 +184,7 @@ void do_fake_networking(int num_cpus)
 			total_packet++;
 		#endif
 		
-		while (networker_pointers.cnt != 0);
-		for (i = 0; i < networker_pointers.free_cnt; i++)
-		{
-			struct request * req = networker_pointers.reqs[i];
-			for (j = 0; j < req->pkts_length; j++) {
-				mbuf_free(req->mbufs[j]);
-			}
-			mempool_free(&request_mempool, req);
-		}
-		networker_pointers.free_cnt = 0;
+		networker_free_requests();
 
 		for (uint64_t t = 0; t < ETH_RX_MAX_BATCH; t++)
 		{
@@ -143,14 +193,13 @@ void do_fake_networking(int num_cpus)
 			struct request * req = fake_work_rq_update(&rqueue, temp, req_type);
 			if(req){
 				/* -------- Generate fake req -------- */ 
-				generate_db_req(req);
+				req->size_hint = generate_db_req(req)->ns;
 				/* -------- Send -------- */ 
-				networker_pointers.reqs[t] = req;
-				networker_pointers.types[t] = req_type; 	
+				networker_push(req, req_type);
 			}
 		}
 		
-		networker_pointers.cnt = ETH_RX_MAX_BATCH;
+		networker_end_burst();
 	}
 }
 
@@ -219,7 +268,7 @@ struct db_req* generate_db_req(struct request * temp)
 	}
 
 	// Wait for given inter-arrival time
-	uint64_t wait_time_cycles = (1000 * CPU_FREQ_GHZ)/(MU*load_level);
+	uint64_t wait_time_cycles = (1000 * CPU_FREQ_GHZ)/(MU*networker_load);
 	uint64_t start_time = rdtsc();
 	while(rdtsc() - start_time < wait_time_cycles);
 	req->ts = get_ns();
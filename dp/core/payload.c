@@ -0,0 +1,164 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * payload.c - scatter-gather views of a request's payload
+ */
+
+#include <string.h>
+
+#include <ix/stddef.h>
+#include <ix/errno.h>
+#include <ix/mbuf.h>
+#include <ix/payload.h>
+#include <ix/dispatch.h>
+
+#include <net/ethernet.h>
+#include <net/ip.h>
+#include <net/udp.h>
+
+/**
+ * payload_msg - finds the struct message of a received packet
+ * @pkt: the packet
+ * @len: set to the length of the payload that follows the message
+ *
+ * Returns the message, or NULL if the UDP length cannot hold one or runs past
+ * the end of the mbuf.
+ */
+struct message * payload_msg(struct mbuf * pkt, uint32_t * len)
+{
+	struct eth_hdr * ethhdr = mbuf_mtod(pkt, struct eth_hdr *);
+	struct ip_hdr * iphdr = mbuf_nextd(ethhdr, struct ip_hdr *);
+	int hdrlen = iphdr->header_len * sizeof(uint32_t);
+	struct udp_hdr * udphdr = mbuf_nextd_off(iphdr, struct udp_hdr *,
+						 hdrlen);
+	uint16_t udplen = ntoh16(udphdr->len);
+
+	if (unlikely(udplen < sizeof(struct udp_hdr) + sizeof(struct message) ||
+		     !mbuf_enough_space(pkt, udphdr, udplen)))
+		return NULL;
+
+	*len = udplen - sizeof(struct udp_hdr) - sizeof(struct message);
+	return mbuf_nextd(udphdr, struct message *);
+}
+
+/**
+ * payload_view_init - builds the payload view of a request
+ * @v: the view, of payload_view_size(req->pkts_length) bytes
+ * @req: the request, with all its packets
+ *
+ * Only the Ethernet header of each packet may have been overwritten, as the
+ * worker does with the ip_tuple of the first one.
+ *
+ * Returns 0 if successful, otherwise -EINVAL if a packet is truncated.
+ */
+int payload_view_init(struct payload_view * v, struct request * req)
+{
+	struct message * msg;
+	uint32_t i, len;
+
+	v->len = 0;
+	v->nr_segs = 0;
+	for (i = 0; i < req->pkts_length; i++) {
+		msg = payload_msg(request_get_mbuf(req, i), &len);
+		if (unlikely(!msg))
+			return -EINVAL;
+		if (i == 0)
+			v->msg = msg;
+		if (!len)
+			continue;
+		v->segs[v->nr_segs].base = (const char *) (msg + 1);
+		v->segs[v->nr_segs].len = len;
+		v->nr_segs++;
+		v->len += len;
+	}
+	return 0;
+}
+
+/* Returns the segment holding byte @off, and the offset in it in @seg_off. */
+static uint32_t payload_find(const struct payload_view * v, size_t off,
+			     size_t * seg_off)
+{
+	uint32_t i;
+
+	for (i = 0; i < v->nr_segs && off >= v->segs[i].len; i++)
+		off -= v->segs[i].len;
+	*seg_off = off;
+	return i;
+}
+
+/**
+ * payload_copy - copies a range of the payload
+ * @v: the view
+ * @off: the offset of the range in the payload
+ * @dst: the destination buffer
+ * @len: the length of the range
+ *
+ * Returns the number of bytes copied, less than @len if the payload ends
+ * first.
+ */
+size_t payload_copy(const struct payload_view * v, size_t off, void * dst,
+		    size_t len)
+{
+	size_t seg_off, n, done = 0;
+	uint32_t i = payload_find(v, off, &seg_off);
+
+	for (; i < v->nr_segs && done < len; i++, seg_off = 0) {
+		n = min(v->segs[i].len - seg_off, len - done);
+		memcpy((char *) dst + done, v->segs[i].base + seg_off, n);
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * payload_slice - gets a range of the payload as contiguous bytes
+ * @v: the view
+ * @off: the offset of the range in the payload
+ * @len: the length of the range
+ * @scratch: a buffer of at least @len bytes, or NULL
+ *
+ * A range within one packet is returned in place. Only a range spanning
+ * packets is gathered into @scratch.
+ *
+ * Returns a pointer to the range, or NULL if it goes past the payload or
+ * spans packets and @scratch is NULL.
+ */
+const char * payload_slice(const struct payload_view * v, size_t off,
+			   size_t len, char * scratch)
+{
+	size_t seg_off;
+	uint32_t i;
+
+	if (unlikely(off + len > v->len))
+		return NULL;
+
+	i = payload_find(v, off, &seg_off);
+	if (i < v->nr_segs && seg_off + len <= v->segs[i].len)
+		return v->segs[i].base + seg_off;
+	if (!scratch)
+		return NULL;
+
+	payload_copy(v, off, scratch, len);
+	return scratch;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * preempt_trace.c - tracing of the Concord preemption points
+ *
+ * With PREEMPT_TRACE=1 every worker logs, in a ring of its own, when its
+ * preemption flag was raised, when it yielded, when a held lock made it
+ * defer the yield and how long concord_lock_counter stayed raised. The rings
+ * are written to PTRACE_FILE at the end of the benchmark; dp/parsetrace.py
+ * turns them into lateness percentiles.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ix/stddef.h>
+#include <ix/dispatch.h>
+#include <ix/log.h>
+#include <ix/preempt_trace.h>
+
+struct ptrace_ring ptrace_rings[MAX_WORKERS];
+__thread struct ptrace_ring *ptrace_ring;
+__thread uint16_t ptrace_worker;
+
+/**
+ * ptrace_init_worker - enables tracing on the calling worker thread
+ * @worker: the worker number
+ *
+ * Other threads, such as a dispatcher running requests itself, leave their
+ * ring unset and record nothing.
+ */
+void ptrace_init_worker(uint8_t worker)
+{
+	ptrace_worker = worker;
+	ptrace_ring = &ptrace_rings[worker];
+}
+
+static int ptrace_write(int fd, struct ptrace_event *events, size_t n)
+{
+	size_t len = n * sizeof(*events);
+	ssize_t ret;
+	char *buf = (char *) events;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Copies a ring that its worker may still be writing into @buf, slot for
+ * slot, and returns in @first and @last the range of events to keep.
+ *
+ * The head is read before and after the copy. Slots the worker overwrote
+ * meanwhile, or may be writing now, are dropped, so that every event kept
+ * was left unchanged during the copy. The newest event may be one the
+ * worker had not finished writing when the head was first read.
+ */
+static void ptrace_snapshot(struct ptrace_ring *r, struct ptrace_event *buf,
+			    uint64_t *first, uint64_t *last)
+{
+	uint64_t head, again;
+
+	head = *(volatile uint64_t *) &r->head;
+	barrier();
+	memcpy(buf, r->events, sizeof(r->events));
+	barrier();
+	again = *(volatile uint64_t *) &r->head;
+
+	*first = head > PTRACE_RING_SIZE ? head - PTRACE_RING_SIZE : 0;
+	if (again + 1 > PTRACE_RING_SIZE + *first)
+		*first = min(again + 1 - PTRACE_RING_SIZE, head);
+	*last = head;
+}
+
+/**
+ * ptrace_dump - writes the events of every worker to PTRACE_FILE
+ * @nr_workers: the number of workers
+ *
+ * Called by a dispatcher while the workers, and the other dispatchers, may
+ * still be running and recording events. Each ring is snapshotted on its
+ * own, so the dump is racy: it holds what every ring had at some point
+ * during the dump, not a consistent cut across workers.
+ *
+ * Returns 0 on success, -1 if failure.
+ */
+int ptrace_dump(int nr_workers)
+{
+	struct ptrace_event *buf;
+	uint64_t total = 0, first, last;
+	uint32_t start, end;
+	int i, fd;
+
+	buf = malloc(PTRACE_RING_SIZE * sizeof(*buf));
+	if (!buf) {
+		log_err("preempt_trace: cannot allocate the dump buffer\n");
+		return -1;
+	}
+
+	fd = open(PTRACE_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_err("preempt_trace: cannot open %s\n", PTRACE_FILE);
+		free(buf);
+		return -1;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		ptrace_snapshot(&ptrace_rings[i], buf, &first, &last);
+		if (first)
+			log_warn("preempt_trace: worker %d lost %llu oldest events\n",
+				 i, first);
+		if (last == first)
+			continue;
+		start = first & PTRACE_RING_MASK;
+		end = ((last - 1) & PTRACE_RING_MASK) + 1;
+		if (start < end) {
+			if (ptrace_write(fd, &buf[start], end - start))
+				goto fail;
+		} else if (ptrace_write(fd, &buf[start], PTRACE_RING_SIZE - start) ||
+			   ptrace_write(fd, buf, end)) {
+			goto fail;
+		}
+		total += last - first;
+	}
+
+	close(fd);
+	free(buf);
+	log_info("preempt_trace: wrote %llu events to %s\n", total, PTRACE_FILE);
+	return 0;
+
+fail:
+	log_err("preempt_trace: cannot write %s\n", PTRACE_FILE);
+	close(fd);
+	free(buf);
+	return -1;
+}
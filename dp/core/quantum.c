@@ -0,0 +1,121 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * quantum.c - adaptive preemption time slice
+ *
+ * Every dispatcher records the service time of the requests its workers
+ * complete, per request type, and periodically picks a new time slice from
+ * those histograms. The slice is made long enough that most requests finish
+ * without being preempted, which keeps the preemption overhead low, and short
+ * enough that a typical request of every type can wait behind one slice of a
+ * long request and still meet its SLO.
+ */
+
+#include <string.h>
+
+#include <ix/stddef.h>
+#include <ix/log.h>
+#include <ix/quantum.h>
+
+#include "benchmark.h"
+
+__thread struct service_hist service_hists[CFG_MAX_PORTS];
+
+/* Largest service time, in ns, that falls into @bucket. */
+static uint64_t service_hist_bucket_max(unsigned int bucket)
+{
+	unsigned int shift, sub;
+
+	if (bucket < (1 << QUANTUM_HIST_SUB_BITS))
+		return bucket;
+	shift = (bucket >> QUANTUM_HIST_SUB_BITS) - 1;
+	sub = bucket & ((1 << QUANTUM_HIST_SUB_BITS) - 1);
+	return (((uint64_t)((1 << QUANTUM_HIST_SUB_BITS) | sub) + 1) << shift) - 1;
+}
+
+static uint64_t service_hist_percentile(struct service_hist *h, unsigned int pct)
+{
+	uint64_t seen = 0, target = (h->total * pct + 99) / 100;
+	unsigned int i;
+
+	for (i = 0; i < QUANTUM_HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen && seen >= target)
+			return service_hist_bucket_max(i);
+	}
+	return 0;
+}
+
+/**
+ * quantum_retune - picks a new time slice from the recorded service times
+ * @quantum: the current time slice, in ns
+ *
+ * Halves all histogram counts afterwards, so older samples fade out over a few
+ * epochs. The result is averaged with @quantum to avoid oscillating.
+ *
+ * Returns the new time slice, in ns.
+ */
+uint64_t quantum_retune(uint64_t quantum)
+{
+	struct service_hist all;
+	uint64_t target, slo, typical;
+	int i, j;
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < CFG.num_ports; i++) {
+		for (j = 0; j < QUANTUM_HIST_BUCKETS; j++)
+			all.counts[j] += service_hists[i].counts[j];
+		all.total += service_hists[i].total;
+	}
+	if (all.total < QUANTUM_MIN_SAMPLES)
+		return quantum;
+
+	target = service_hist_percentile(&all, QUANTUM_PERCENTILE);
+	target += target / 4;
+
+	for (i = 0; i < CFG.num_ports && i < CFG.num_slos; i++) {
+		if (!service_hists[i].total)
+			continue;
+		slo = CFG.slos[i];
+		typical = service_hist_percentile(&service_hists[i], 50);
+		/* Types that miss their SLO on their own do not constrain us. */
+		if (slo > typical && target > slo - typical)
+			target = slo - typical;
+	}
+
+	if (target < QUANTUM_MIN_NS)
+		target = QUANTUM_MIN_NS;
+	if (target > QUANTUM_MAX_NS)
+		target = QUANTUM_MAX_NS;
+
+	for (i = 0; i < CFG.num_ports; i++) {
+		service_hists[i].total = 0;
+		for (j = 0; j < QUANTUM_HIST_BUCKETS; j++) {
+			service_hists[i].counts[j] >>= 1;
+			service_hists[i].total += service_hists[i].counts[j];
+		}
+	}
+
+	return (quantum + target) / 2;
+}
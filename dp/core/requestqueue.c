@@ -21,28 +21,33 @@
  */
 
 /*
- * taskqueue.c - taskqueue management
+ * requestqueue.c - request allocation and reassembly
+ *
+ * A networker reassembles multi-packet requests in its own request_queue.
+ * Each request in reassembly has a cell with a timer on the networker's
+ * timer wheel; if its last packet does not arrive within
+ * CFG.reassembly_timeout the packets received so far are dropped.
  */
 
 #include <ix/mem.h>
 #include <ix/stddef.h>
 #include <ix/mempool.h>
+#include <ix/mbuf.h>
+#include <ix/log.h>
+#include <ix/cfg.h>
+#include <ix/timer.h>
 #include <ix/dispatch.h>
+#include <ix/payload.h>
+
+#include <net/ethernet.h>
 
 #define REQUEST_CAPACITY    (768*1024)
-#define RQ_CAPACITY   (768*1024)
+#define RQ_CAPACITY   (MAX_NETWORKERS * RQ_TABLE_SIZE)
+#define REQUEST_OVERFLOW_CAPACITY   (16*1024)
 
-static int request_init_mempool(void)
-{
-	struct mempool *m = &request_mempool;
-	return mempool_create(m, &request_datastore, MEMPOOL_SANITY_GLOBAL, 0);
-}
-
-static int rq_init_mempool(void)
-{
-	struct mempool *m = &rq_mempool;
-	return mempool_create(m, &rq_datastore, MEMPOOL_SANITY_GLOBAL, 0);
-}
+DEFINE_PERCPU(struct mempool, request_mempool __attribute__((aligned(64))));
+DEFINE_PERCPU(struct mempool, rq_mempool __attribute__((aligned(64))));
+DEFINE_PERCPU(struct mempool, request_overflow_mempool __attribute__((aligned(64))));
 
 /**
  * request_init - allocate request mempool
@@ -61,20 +66,251 @@ int request_init(void)
 		return ret;
 	}
 
-        ret = request_init_mempool();
-        if (ret) {
-                return ret;
-        }
-
 	ret = mempool_create_datastore(rq, RQ_CAPACITY, sizeof(struct request_cell),
                                        1, MEMPOOL_DEFAULT_CHUNKSIZE, "rq_cell");
 	if (ret) {
 		return ret;
 	}
 
-        ret = rq_init_mempool();
-        if (ret) {
-                return ret;
-        }
+	ret = mempool_create_datastore(&request_overflow_datastore,
+				       REQUEST_OVERFLOW_CAPACITY,
+				       sizeof(struct request_overflow), 1,
+				       MEMPOOL_DEFAULT_CHUNKSIZE, "request_overflow");
+	if (ret) {
+		return ret;
+	}
+
         return 0;
 }
+
+/**
+ * request_init_cpu - creates the per cpu request mempools
+ *
+ * Each networker allocates requests from its own pools. A request may be
+ * freed on another networker, whose pools share the same datastores.
+ *
+ * Returns 0 if successful, otherwise failure.
+ */
+int request_init_cpu(void)
+{
+	int ret;
+
+	ret = mempool_create(&percpu_get(request_mempool), &request_datastore,
+			     MEMPOOL_SANITY_PERCPU, percpu_get(cpu_id));
+	if (ret)
+		return ret;
+
+	ret = mempool_create(&percpu_get(rq_mempool), &rq_datastore,
+			     MEMPOOL_SANITY_PERCPU, percpu_get(cpu_id));
+	if (ret)
+		return ret;
+
+	return mempool_create(&percpu_get(request_overflow_mempool),
+			      &request_overflow_datastore,
+			      MEMPOOL_SANITY_PERCPU, percpu_get(cpu_id));
+}
+
+static struct request * request_alloc(uint16_t type, uint32_t pkts_length,
+				      uint64_t size_hint)
+{
+	struct request * req = mempool_alloc(&percpu_get(request_mempool));
+
+	if (unlikely(!req))
+		return NULL;
+
+	req->type = type;
+	req->pkts_length = pkts_length;
+	req->size_hint = size_hint;
+	req->service_ns = 0;
+	req->overflow = NULL;
+	if (pkts_length > REQUEST_INLINE_PKTS) {
+		req->overflow = mempool_alloc(&percpu_get(request_overflow_mempool));
+		if (unlikely(!req->overflow)) {
+			mempool_free(&percpu_get(request_mempool), req);
+			return NULL;
+		}
+	}
+	return req;
+}
+
+/**
+ * request_free - frees a request and the packets it holds
+ * @req: the request
+ *
+ * Packets that never arrived are skipped.
+ */
+void request_free(struct request * req)
+{
+	uint32_t i;
+	void * pkt;
+
+	for (i = 0; i < req->pkts_length; i++) {
+		pkt = request_get_mbuf(req, i);
+		if (pkt)
+			mbuf_free(pkt);
+	}
+	if (req->overflow)
+		mempool_free(&percpu_get(request_overflow_mempool), req->overflow);
+	mempool_free(&percpu_get(request_mempool), req);
+}
+
+static inline uint32_t rq_hash(uint16_t client_id, uint32_t req_id)
+{
+	return ((((uint32_t) client_id << 16) ^ req_id) * 2654435761u) >>
+	       (32 - RQ_TABLE_SHIFT);
+}
+
+/* Returns the slot of the request, or the free slot it would go in. */
+static struct rq_slot * rq_lookup(struct request_queue * rq,
+				  uint16_t client_id, uint32_t req_id)
+{
+	uint32_t i = rq_hash(client_id, req_id);
+	struct rq_slot * s;
+
+	while (1) {
+		s = &rq->slots[i];
+		if (!s->cell || (s->req_id == req_id && s->client_id == client_id))
+			return s;
+		i = (i + 1) & RQ_TABLE_MASK;
+	}
+}
+
+/*
+ * Frees a slot, moving back the entries after it that would no longer be
+ * found otherwise, so that lookups never need tombstones.
+ */
+static void rq_remove(struct request_queue * rq, struct rq_slot * s)
+{
+	uint32_t i = s - rq->slots, j = i, home;
+
+	while (1) {
+		j = (j + 1) & RQ_TABLE_MASK;
+		if (!rq->slots[j].cell)
+			break;
+		home = rq_hash(rq->slots[j].client_id, rq->slots[j].req_id);
+		if (((j - home) & RQ_TABLE_MASK) >= ((j - i) & RQ_TABLE_MASK)) {
+			rq->slots[i] = rq->slots[j];
+			i = j;
+		}
+	}
+	rq->slots[i].cell = NULL;
+	rq->count--;
+}
+
+static void rq_expire(struct timer * t, struct eth_fg * cur_fg)
+{
+	struct request_cell * rc = container_of(t, struct request_cell, timer);
+	struct request_queue * rq = rc->rq;
+
+	log_debug("rq: dropping request %u of client %u, %u packets missing\n",
+		  rc->req_id, rc->client_id, rc->pkts_remaining);
+	rq_remove(rq, rq_lookup(rq, rc->client_id, rc->req_id));
+	request_free(rc->req);
+	mempool_free(&percpu_get(rq_mempool), rc);
+}
+
+static struct request_cell * rq_start(struct request_queue * rq,
+				      struct rq_slot * s, struct message * msg,
+				      uint16_t type, uint32_t pkts_length)
+{
+	uint32_t i;
+	struct request_cell * rc;
+	struct request * req;
+
+	if (unlikely(rq->count >= RQ_TABLE_MAX_LOAD))
+		return NULL;
+
+	rc = mempool_alloc(&percpu_get(rq_mempool));
+	if (unlikely(!rc))
+		return NULL;
+	req = request_alloc(type, pkts_length, msg->runNs);
+	if (unlikely(!req)) {
+		mempool_free(&percpu_get(rq_mempool), rc);
+		return NULL;
+	}
+	for (i = 0; i < pkts_length; i++)
+		request_set_mbuf(req, i, NULL);
+
+	rc->req_id = msg->req_id;
+	rc->client_id = msg->client_id;
+	rc->pkts_remaining = pkts_length;
+	rc->req = req;
+	rc->rq = rq;
+	timer_init_entry(&rc->timer, rq_expire);
+	timer_add(&rc->timer, NULL, CFG.reassembly_timeout);
+
+	s->req_id = msg->req_id;
+	s->client_id = msg->client_id;
+	s->cell = rc;
+	rq->count++;
+	return rc;
+}
+
+/**
+ * rq_update - adds a received packet to its request
+ * @rq: the networker's request queue
+ * @pkt: the packet
+ *
+ * Packets too short to hold a struct message, packets with an impossible
+ * length or sequence number, duplicates, and the first packet of a request
+ * that cannot be tracked are dropped.
+ *
+ * Returns the request once all its packets arrived, otherwise NULL.
+ */
+struct request * rq_update(struct request_queue * rq, struct mbuf * pkt)
+{
+	struct message * msg;
+	struct request_cell * rc;
+	struct request * req;
+	struct rq_slot * s;
+	uint32_t pkts_length, len;
+	uint16_t type, seq_num;
+
+	/* The message header must be in the packet before it is read. */
+	msg = payload_msg(pkt, &len);
+	if (unlikely(!msg))
+		goto drop;
+
+	type = msg->type - req_offset;
+	log_debug("RQ received packet type %d\n", type);
+	seq_num = msg->seq_num;
+	pkts_length = msg->pkts_length / sizeof(struct message);
+
+	if (unlikely(!pkts_length || pkts_length > REQUEST_MAX_PKTS ||
+		     seq_num >= pkts_length))
+		goto drop;
+
+	if (pkts_length == 1) {
+		req = request_alloc(type, 1, msg->runNs);
+		if (unlikely(!req))
+			goto drop;
+		req->mbufs[0] = pkt;
+		return req;
+	}
+
+	s = rq_lookup(rq, msg->client_id, msg->req_id);
+	rc = s->cell;
+	if (!rc) {
+		rc = rq_start(rq, s, msg, type, pkts_length);
+		if (unlikely(!rc))
+			goto drop;
+	}
+
+	req = rc->req;
+	if (unlikely(req->pkts_length != pkts_length))
+		goto drop;
+	if (unlikely(request_get_mbuf(req, seq_num)))
+		goto drop;
+	request_set_mbuf(req, seq_num, pkt);
+	if (--rc->pkts_remaining)
+		return NULL;
+
+	timer_del(&rc->timer);
+	rq_remove(rq, s);
+	mempool_free(&percpu_get(rq_mempool), rc);
+	return req;
+
+drop:
+	mbuf_free(pkt);
+	return NULL;
+}
@@ -0,0 +1,302 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * stack.c - guard-paged request stacks
+ *
+ * Each size class owns one region of 2MB pages per NUMA node with workers,
+ * remapped with 4KB pages and cut into slots of a guard page followed by a
+ * stack. A node gets a share of the stacks proportional to its workers.
+ * Guard pages stay unmapped, and the page fault handler treats a fault in
+ * one as a stack overflow rather than mapping it on demand. Free stacks are
+ * kept in small per-cpu caches in front of a locked free list per region.
+ *
+ * A sample of the stacks is filled with a canary when allocated and scanned
+ * when freed. The deepest use seen for each request type is compared with
+ * its class, and a better fitting stack_size is suggested in the log.
+ */
+
+#include <stdlib.h>
+
+#include <ix/stddef.h>
+#include <ix/errno.h>
+#include <ix/dispatch.h>
+#include <ix/log.h>
+#include <ix/page.h>
+#include <ix/stack.h>
+#include <ix/vm.h>
+
+#include <dune.h>
+
+/* Headroom a recommended class leaves above the deepest observed use. */
+#define STACK_HEADROOM_PCT  25
+
+static const int stack_capacity[STACK_NR_CLASSES] = {
+	[STACK_CLASS_4KB]  = 128 * 1024,
+	[STACK_CLASS_16KB] = 64 * 1024,
+	[STACK_CLASS_64KB] = 8 * 1024,
+};
+
+static const char *stack_class_names[STACK_NR_CLASSES] = {
+	[STACK_CLASS_4KB]  = "4096",
+	[STACK_CLASS_16KB] = "16384",
+	[STACK_CLASS_64KB] = "65536",
+};
+
+static const size_t stack_class_sizes[STACK_NR_CLASSES] = {
+	[STACK_CLASS_4KB]  = 4 * 1024,
+	[STACK_CLASS_16KB] = 16 * 1024,
+	[STACK_CLASS_64KB] = 64 * 1024,
+};
+
+struct stack_class stack_classes[STACK_MAX_NODES][STACK_NR_CLASSES];
+
+DEFINE_PERCPU(struct stack_cache, stack_caches[STACK_MAX_NODES][STACK_NR_CLASSES]);
+DEFINE_PERCPU(uint32_t, stack_allocs);
+
+uint8_t cpu_nodes[NCPU];
+
+/* Workers on each node, out of all of them. */
+static int node_workers[STACK_MAX_NODES];
+static int nr_workers;
+
+/* Deepest sampled use per request type, and the class last suggested. */
+static size_t stack_hwm[CFG_MAX_PORTS];
+static int8_t stack_advice[CFG_MAX_PORTS];
+
+static inline size_t stack_slot(struct stack_class *sc)
+{
+	return sc->size + STACK_GUARD_SIZE;
+}
+
+/**
+ * stack_node_share - splits a capacity between the nodes with workers
+ * @capacity: the total number of elements
+ * @node: the node
+ *
+ * Returns the node's share, rounded up to a multiple of STACK_CACHE_SIZE.
+ */
+int stack_node_share(int capacity, int node)
+{
+	return align_up(div_up(capacity * node_workers[node], nr_workers),
+			STACK_CACHE_SIZE);
+}
+
+static void stack_init_nodes(void)
+{
+	int i, node;
+
+	for (i = 0; i < CFG.num_cpus; i++) {
+		node = numa_node_of_cpu(CFG.cpu[i]);
+		if (node < 0 || node >= STACK_MAX_NODES) {
+			log_warn("stack: cpu %d is on node %d, using node 0\n",
+				 CFG.cpu[i], node);
+			node = 0;
+		}
+		cpu_nodes[CFG.cpu[i]] = node;
+		if (i >= WORKER_CPU_BASE) {
+			node_workers[node]++;
+			nr_workers++;
+		}
+	}
+}
+
+static int stack_class_init(int node, int cls)
+{
+	struct stack_class *sc = &stack_classes[node][cls];
+	int i, ret, nr, nr_pages;
+	uintptr_t stack;
+
+	nr = stack_node_share(stack_capacity[cls], node);
+	nr_pages = div_up(nr * stack_slot(sc), PGSIZE_2MB);
+	sc->base = (uintptr_t) page_alloc_contig_on_node(nr_pages, node);
+	if (!sc->base)
+		return -ENOMEM;
+	sc->end = sc->base + nr * stack_slot(sc);
+
+	sc->free = malloc(nr * sizeof(void *));
+	if (!sc->free)
+		return -ENOMEM;
+
+	/* Memory is mapped P = V, so the stacks keep their physical pages. */
+	vm_unmap((void *) sc->base, nr_pages, PGSIZE_2MB);
+	for (i = 0; i < nr; i++) {
+		stack = sc->base + i * stack_slot(sc) + STACK_GUARD_SIZE;
+		ret = vm_map_phys((physaddr_t) stack, (virtaddr_t) stack,
+				  sc->size / PGSIZE_4KB, PGSIZE_4KB,
+				  VM_PERM_R | VM_PERM_W);
+		if (ret)
+			return ret;
+		sc->free[i] = (void *) stack;
+	}
+	sc->nr_free = nr;
+
+	log_info("stack: %d stacks of %lu bytes with guard pages on node %d\n",
+		 nr, sc->size, node);
+	return 0;
+}
+
+/**
+ * stack_init - builds the stack regions of every size class and node
+ */
+int stack_init(void)
+{
+	int node, cls, ret;
+
+	stack_init_nodes();
+	for (node = 0; node < STACK_MAX_NODES; node++) {
+		for (cls = 0; cls < STACK_NR_CLASSES; cls++) {
+			struct stack_class *sc = &stack_classes[node][cls];
+
+			sc->size = stack_class_sizes[cls];
+			sc->node = node;
+			sc->cls = cls;
+			spin_lock_init(&sc->lock);
+			if (!node_workers[node])
+				continue;
+			ret = stack_class_init(node, cls);
+			if (ret) {
+				log_err("stack: cannot set up %s byte stacks on node %d\n",
+					stack_class_names[cls], node);
+				return ret;
+			}
+		}
+	}
+	dune_flush_tlb();
+	memset(stack_advice, -1, sizeof(stack_advice));
+	return 0;
+}
+
+/**
+ * stack_refill - moves half a cache worth of stacks from the free list
+ * @c: the empty per-cpu cache
+ * @sc: its class and node
+ *
+ * Returns one of the stacks, or NULL if the region has none left.
+ */
+void *stack_refill(struct stack_cache *c, struct stack_class *sc)
+{
+	int n;
+
+	spin_lock(&sc->lock);
+	n = min(sc->nr_free, STACK_CACHE_SIZE / 2);
+	sc->nr_free -= n;
+	memcpy(c->stacks, &sc->free[sc->nr_free], n * sizeof(void *));
+	spin_unlock(&sc->lock);
+
+	if (unlikely(!n))
+		return NULL;
+	c->cnt = n - 1;
+	return c->stacks[n - 1];
+}
+
+/**
+ * stack_drain - moves half of a full per-cpu cache to the free list
+ * @c: the cache
+ * @sc: its class and node
+ */
+void stack_drain(struct stack_cache *c, struct stack_class *sc)
+{
+	int n = STACK_CACHE_SIZE / 2;
+
+	c->cnt -= n;
+	spin_lock(&sc->lock);
+	memcpy(&sc->free[sc->nr_free], &c->stacks[c->cnt], n * sizeof(void *));
+	sc->nr_free += n;
+	spin_unlock(&sc->lock);
+}
+
+/**
+ * stack_paint - fills a stack and its tag with the canary
+ * @stack: the stack
+ * @sc: its class and node
+ */
+void stack_paint(void *stack, struct stack_class *sc)
+{
+	uint64_t *pos = stack, *tag = stack_tag(stack, sc->cls);
+
+	while (pos <= tag)
+		*pos++ = STACK_CANARY;
+}
+
+/* Smallest class leaving the headroom above @used, or the largest one. */
+static int stack_recommend(size_t used)
+{
+	size_t need = used + used * STACK_HEADROOM_PCT / 100;
+	int cls;
+
+	for (cls = 0; cls < STACK_NR_CLASSES - 1; cls++) {
+		if (need <= stack_size(cls))
+			break;
+	}
+	return cls;
+}
+
+/**
+ * stack_sample - accounts the usage of a painted stack
+ * @stack: the stack
+ * @sc: its class and node
+ * @type: the type of the request that ran on it
+ *
+ * Dispatchers update the per-type maximum without synchronization; a lost
+ * update only delays the next suggestion.
+ */
+void stack_sample(void *stack, struct stack_class *sc, uint8_t type)
+{
+	uint64_t *pos = stack, *tag = stack_tag(stack, sc->cls);
+	size_t used;
+	int advice;
+
+	while (pos < tag && *pos == STACK_CANARY)
+		pos++;
+	*tag = 0;
+
+	used = (uintptr_t) tag - (uintptr_t) pos;
+	if (type >= CFG_MAX_PORTS || used <= stack_hwm[type])
+		return;
+	stack_hwm[type] = used;
+
+	advice = stack_recommend(used);
+	if (advice == stack_advice[type])
+		return;
+	stack_advice[type] = advice;
+	if (advice != sc->cls)
+		log_info("stack: type %d used %lu of %lu bytes, suggest stack_size %s\n",
+			 type, used, stack_size(sc->cls), stack_class_names[advice]);
+}
+
+/**
+ * stack_is_guard - tells if an address is in a stack guard page
+ * @addr: the faulting address
+ */
+bool stack_is_guard(uintptr_t addr)
+{
+	struct stack_class *sc = &stack_classes[0][0];
+	int i;
+
+	for (i = 0; i < STACK_MAX_NODES * STACK_NR_CLASSES; i++, sc++) {
+		if (addr >= sc->base && addr < sc->end)
+			return (addr - sc->base) % stack_slot(sc) < STACK_GUARD_SIZE;
+	}
+	return false;
+}
@@ -25,56 +25,145 @@
  */
 
 #include <ix/mem.h>
+#include <ix/errno.h>
 #include <ix/stddef.h>
 #include <ix/mempool.h>
 #include <ix/dispatch.h>
 
-#define TASK_CAPACITY    (768*1024)
 #define MCELL_CAPACITY   (768*1024)
 
-static int task_init_mempool(void)
+DEFINE_PERCPU(struct mempool, fini_request_cell_mempool __attribute__((aligned(64))));
+
+__thread struct task_queue tskq[SCHED_MAX_CLASSES];
+__thread struct task_queue tskq_ports[CFG_MAX_PORTS];
+__thread struct task_heap task_heaps[SCHED_MAX_CLASSES][TASK_CATEGORIES];
+__thread uint32_t sched_queued;
+__thread uint32_t sched_seq;
+__thread uint32_t sched_class_queued[SCHED_MAX_CLASSES];
+
+/**
+ * tskq_init - allocates the rings backing a task queue
+ * @tq: the task queue
+ *
+ * The rings are allocated from huge pages on the caller's NUMA node, so this
+ * should run on the core that owns the queue.
+ *
+ * Returns 0 if successful, otherwise failure.
+ */
+int tskq_init(struct task_queue * tq)
 {
-	struct mempool *m = &task_mempool;
-	return mempool_create(m, &task_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+	int i;
+	size_t len = TASK_QUEUE_SIZE * sizeof(struct task);
+	struct task * tasks;
+
+	tasks = mem_alloc_pages(div_up(TASK_CATEGORIES * len, PGSIZE_2MB),
+				PGSIZE_2MB, NULL, MPOL_PREFERRED);
+	if (tasks == MAP_FAILED || !tasks)
+		return -ENOMEM;
+
+	for (i = 0; i < TASK_CATEGORIES; i++) {
+		tq->rings[i].head = 0;
+		tq->rings[i].tail = 0;
+		tq->rings[i].tasks = tasks + i * TASK_QUEUE_SIZE;
+	}
+	tq->head_seq = 0;
+	tq->tail_seq = 0;
+	return 0;
 }
 
-static int fini_request_cell_init_mempool(void)
+/**
+ * task_heap_init - allocates the arrays backing the task heaps of a class
+ * @heaps: the heaps of the class, one per category
+ *
+ * Returns 0 if successful, otherwise failure.
+ */
+static int task_heap_init(struct task_heap * heaps)
 {
-	struct mempool *m = &fini_request_cell_mempool;
-	return mempool_create(m, &fini_request_cell_datastore, MEMPOOL_SANITY_GLOBAL, 0);
+	int i;
+	size_t klen = TASK_QUEUE_SIZE * sizeof(uint64_t);
+	size_t tlen = TASK_QUEUE_SIZE * sizeof(struct task);
+	void *mem;
+
+	mem = mem_alloc_pages(div_up(TASK_CATEGORIES * (klen + tlen), PGSIZE_2MB),
+			      PGSIZE_2MB, NULL, MPOL_PREFERRED);
+	if (mem == MAP_FAILED || !mem)
+		return -ENOMEM;
+
+	for (i = 0; i < TASK_CATEGORIES; i++) {
+		heaps[i].len = 0;
+		heaps[i].tasks = (struct task *) mem + i * TASK_QUEUE_SIZE;
+		heaps[i].keys = (uint64_t *) ((char *) mem +
+			TASK_CATEGORIES * tlen) + i * TASK_QUEUE_SIZE;
+	}
+	return 0;
 }
 
 /**
- * taskqueue_init - allocate global task mempool
+ * sched_init - allocates the task queues used by the scheduling policy
+ *
+ * Only the structure backing CFG.sched_policy is allocated, once per priority
+ * class in use. Must run on the dispatcher core that owns the queues.
  *
  * Returns 0 if successful, otherwise failure.
  */
-int taskqueue_init(void)
+int sched_init(void)
 {
-	int ret;
-	struct mempool_datastore *t = &task_datastore;
-	struct mempool_datastore *m = &fini_request_cell_datastore;
+	int i, ret;
 
-	ret = mempool_create_datastore(t, TASK_CAPACITY, sizeof(struct task),
-                                       1, MEMPOOL_DEFAULT_CHUNKSIZE, "task");
-	if (ret) {
-		return ret;
+	sched_queued = 0;
+	sched_seq = 0;
+	for (i = 0; i < SCHED_MAX_CLASSES; i++)
+		sched_class_queued[i] = 0;
+
+	if (CFG.sched_policy == SCHED_SLO) {
+		for (i = 0; i < CFG.num_ports; i++) {
+			ret = tskq_init(&tskq_ports[i]);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < CFG.sched_classes; i++) {
+		if (CFG.sched_policy == SCHED_SRPT || CFG.sched_policy == SCHED_EDF)
+			ret = task_heap_init(task_heaps[i]);
+		else
+			ret = tskq_init(&tskq[i]);
+		if (ret)
+			return ret;
 	}
+	return 0;
+}
 
-        ret = task_init_mempool();
-        if (ret) {
-                return ret;
-        }
+/**
+ * taskqueue_init - allocate global finished-request datastore
+ *
+ * Returns 0 if successful, otherwise failure.
+ */
+int taskqueue_init(void)
+{
+	int ret;
+	struct mempool_datastore *m = &fini_request_cell_datastore;
 
 	ret = mempool_create_datastore(m, MCELL_CAPACITY, sizeof(struct fini_request_cell),
                                        1, MEMPOOL_DEFAULT_CHUNKSIZE, "frcell");
 	if (ret) {
 		return ret;
 	}
-
-        ret = fini_request_cell_init_mempool();
-        if (ret) {
-                return ret;
-        }
         return 0;
 }
+
+/**
+ * taskqueue_init_cpu - allocates per cpu finished-request mempools
+ *
+ * Every dispatcher owns its finished-request queue, so the pool backing it is
+ * per cpu.
+ *
+ * Returns 0 if successful, otherwise failure.
+ */
+int taskqueue_init_cpu(void)
+{
+	return mempool_create(&percpu_get(fini_request_cell_mempool),
+			      &fini_request_cell_datastore,
+			      MEMPOOL_SANITY_PERCPU, percpu_get(cpu_id));
+}
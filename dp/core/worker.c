@@ -28,6 +28,7 @@
  * request.
  */
 
+#include <alloca.h>
 #include <ucontext.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -41,7 +42,6 @@
 
 // Added for leveldb
 #include <ix/leveldb.h>
-#include <ix/hijack.h>
 #include <leveldb/c.h>
 
 #include <ix/cpu.h>
@@ -50,6 +50,8 @@
 #include <asm/cpu.h>
 #include <ix/context.h>
 #include <ix/dispatch.h>
+#include <ix/payload.h>
+#include <ix/preempt_trace.h>
 #include <ix/transmit.h>
 
 #include <dune.h>
@@ -71,19 +73,44 @@
 #define gettid() ((pid_t)syscall(SYS_gettid))
 
 extern volatile int * cpu_preempt_points [MAX_WORKERS];
+extern __thread uint64_t concord_preempt_after_cycle;
+extern __thread uint64_t concord_start_time;
 
 __thread int concord_preempt_now;
 __thread int concord_lock_counter;
+/*
+ * Probe that found concord_lock_counter held and was not taken, rerun as soon
+ * as the counter drops back to 0. NULL when no yield is pending.
+ */
+__thread void (*concord_pending_yield)(void);
+
+void concord_func();
 
 void concord_disable()
 {
+    void (*yield)(void);
+
     // printf("Disabling concord\n");
     concord_lock_counter -= 1;
+    if (concord_lock_counter != 0)
+        return;
+#if PREEMPT_TRACE == 1
+    ptrace_lock_release();
+#endif
+    yield = concord_pending_yield;
+    if (unlikely(yield)) {
+        concord_pending_yield = NULL;
+        yield();
+    }
 }
 
 void concord_enable()
 {
     // printf("Enabling concord\n");
+#if PREEMPT_TRACE == 1
+    if (concord_lock_counter == 0)
+        ptrace_lock_acquire();
+#endif
     concord_lock_counter += 1;
 }
 
@@ -109,6 +136,18 @@ extern leveldb_writeoptions_t *woptions;
 
 #define PREEMPT_VECTOR 0xf2
 
+/*
+ * Responses wait in the worker's txq and go to the NIC together, with one
+ * eth_tx_xmit. They are sent once CFG.tx_batch of them are held, as soon
+ * as the worker has no request to run, and before it runs a request that
+ * could keep the oldest past CFG.tx_deadline us. A request returns to the
+ * main loop by the end of its time slice, so the deadline holds unless the
+ * request defers its preemption, for instance while it holds a lock.
+ */
+static __thread uint64_t tx_deadline_cycles;
+/* When the oldest response held was queued, 0 if none is. */
+static __thread uint64_t tx_held_since;
+
 /* Turn on to debug time lost in waiting for new req. ITERATOR_LIMIT must be power of 2*/
 #define ITERATOR_LIMIT 1
 
@@ -165,12 +204,11 @@ __thread ucontext_t *cont;
 __thread int cpu_nr_;
 __thread volatile uint8_t finished;
 __thread uint8_t active_req;
+/* fpu_save mode of the request in the current slot */
+__thread uint8_t fpu_save;
 
 extern volatile bool INIT_FINISHED;
 
-// Added for leveldb
-extern uint8_t flag;
-
 DEFINE_PERCPU(struct mempool, response_pool __attribute__((aligned(64))));
 
 extern int getcontext_fast(ucontext_t *ucp);
@@ -203,6 +241,68 @@ int response_init_cpu(void)
                               percpu_get(cpu_id));
 }
 
+static inline uint8_t type_fpu_save(uint8_t type)
+{
+    if (type < CFG.num_fpu_saves)
+        return CFG.fpu_saves[type];
+    return FPU_SAVE_ENV;
+}
+
+/*
+ * Switches the preempted context back to the worker loop, keeping the state
+ * its fpu_save mode asks for. With "xsave" the SSE/AVX registers are saved
+ * here, on the way out, and restored once the context is resumed.
+ */
+static inline void yield_to_control(void)
+{
+    struct xstate *xs;
+
+    switch (fpu_save) {
+    case FPU_SAVE_NONE:
+        swapcontext_very_fast(cont, &uctx_main);
+        break;
+    case FPU_SAVE_XSAVE:
+        xs = context_xstate(cont);
+        xstate_save(xs);
+        swapcontext_fast_to_control(cont, &uctx_main);
+        xstate_restore(xs);
+        break;
+    default:
+        swapcontext_fast_to_control(cont, &uctx_main);
+        break;
+    }
+}
+
+/* Resumes a context preempted by yield_to_control. */
+static inline int resume_context(void)
+{
+    if (fpu_save == FPU_SAVE_NONE)
+        return swapcontext_very_fast(&uctx_main, cont);
+    return swapcontext_fast(&uctx_main, cont);
+}
+
+/*
+ * Yields from inside the request. The context switch does not carry RFLAGS
+ * and the main loop runs with interrupts off: give the request back the IF
+ * it yielded with, or no IPI could preempt it again until its next sti.
+ */
+static void concord_yield(void)
+{
+    unsigned long flags;
+
+    flags = read_rflags();
+    yield_to_control();
+    if (flags & X86_EFLAGS_IF)
+        asm volatile("sti" ::: "memory");
+}
+
+/* An IPI that found concord_lock_counter held, taken once it drops to 0. */
+static void concord_ipi_func(void)
+{
+    preempt_counts[cpu_nr_].ipi++;
+    concord_yield();
+}
+
 static void test_handler(struct dune_tf *tf)
 {
     asm volatile("cli" :::);
@@ -212,46 +312,114 @@ static void test_handler(struct dune_tf *tf)
     #endif
     dune_apic_eoi();
 
+#if SCHEDULE_METHOD == METHOD_HYBRID
+    /*
+     * A probe ran since the dispatcher gave up on it: the request either
+     * yielded already or is in a critical section and will yield at its end.
+     */
+    if (!concord_preempt_now)
+        return;
+    concord_preempt_now = 0;
+#endif
+    /* Inside the allocator or a Concord lock: yield once it is left. */
+    if (concord_lock_counter != 0) {
+        concord_pending_yield = concord_ipi_func;
+        return;
+    }
+    preempt_counts[cpu_nr_].ipi++;
+
     /* Turn on to benchmark timeliness of yields */
     // if(cpu_nr_ == MAGIC_CPU)
     //     idle_timestamps[idle_timestamp_iterator].before_ctx = rdtsc();
 
-    swapcontext_fast_to_control(cont, &uctx_main);
+    yield_to_control();
 }
 
 void concord_func()
 {
     // printf("Concord func called from tid %d\n", gettid());
+    concord_preempt_now = 0;
     if(concord_lock_counter != 0)
     {
+        /* Taken by concord_disable() once the lock is released. */
+        concord_pending_yield = concord_func;
+#if PREEMPT_TRACE == 1
+        ptrace_probe(true);
+#endif
         return;
     }
-    concord_preempt_now = 0;
+#if PREEMPT_TRACE == 1
+    ptrace_probe(false);
+#endif
+    preempt_counts[cpu_nr_].probe++;
 
     /* Turn on to benchmark timeliness of yields */
     // if(cpu_nr_ == MAGIC_CPU)
     //     idle_timestamps[idle_timestamp_iterator].before_ctx = rdtsc();
 
-    swapcontext_fast_to_control(cont, &uctx_main);
+    concord_yield();
+}
+
+/**
+ * payload_put - stores the key and value carried in a request's payload
+ * @payload: the payload, a KEYSIZE key followed by the value
+ *
+ * A value held in a single packet goes to LevelDB in place. One that spans
+ * packets is gathered into a buffer of the request's own, as LevelDB's C
+ * API only takes contiguous values.
+ */
+static void payload_put(const struct payload_view *payload)
+{
+    char keybuf[KEYSIZE];
+    const char *key, *val;
+    char *gather = NULL;
+    char *db_err = NULL;
+    size_t val_len = payload->len - KEYSIZE;
+
+    key = payload_slice(payload, 0, KEYSIZE, keybuf);
+    val = payload_slice(payload, KEYSIZE, val_len, NULL);
+    if (!val) {
+        gather = malloc(val_len);
+        if (unlikely(!gather)) {
+            log_warn("worker: no memory for a %zu byte value\n", val_len);
+            return;
+        }
+        val = payload_slice(payload, KEYSIZE, val_len, gather);
+    }
+
+    leveldb_put(db, woptions, key, KEYSIZE, val, val_len, &db_err);
+    free(gather);
+
+    if (db_err != NULL) {
+        log_warn("worker: put of a %zu byte value failed: %s\n",
+                 val_len, db_err);
+        leveldb_free(db_err);
+    }
 }
 
 /**
  * generic_work - generic function acting as placeholder for application-level
  *                work
- * @msw: the top 32-bits of the pointer containing the data
- * @lsw: the bottom 32 bits of the pointer containing the data
+ * @r: the request
+ * @id: the request's addresses and ports
  */
-static void generic_work(uint32_t msw, uint32_t lsw, uint32_t msw_id,
-                         uint32_t lsw_id)
+static void generic_work(struct request *r, struct ip_tuple *id)
 {
     asm volatile("sti" ::
                      :);
 
-    struct ip_tuple *id = (struct ip_tuple *)((uint64_t)msw_id << 32 | lsw_id);
-    void *data = (void *)((uint64_t)msw << 32 | lsw);
     int ret;
+    /* Sized for this request, a few words for a single packet. */
+    struct payload_view *payload = alloca(payload_view_size(r->pkts_length));
 
-    struct message * req = (struct message *) data;
+    if (unlikely(payload_view_init(payload, r))) {
+        log_debug("worker: truncated packet in request\n");
+        asm volatile ("cli":::);
+        finished = true;
+        swapcontext_very_fast(cont, &uctx_main);
+    }
+
+    struct message * req = payload->msg;
 
     // Added for leveldb
     // leveldb_readoptions_t *readoptions = leveldb_readoptions_create();
@@ -281,7 +449,10 @@ static void generic_work(uint32_t msw, uint32_t lsw, uint32_t msw_id,
         simpleloop(BENCHMARK_DB_ITERATOR_SPIN);
     }
     else if (req->runNs == 20000) {
-        simpleloop(BENCHMARK_DB_PUT_SPIN);
+        if (payload->len > KEYSIZE)
+            payload_put(payload);
+        else
+            simpleloop(BENCHMARK_DB_PUT_SPIN);
     }
     else if (req->runNs == 88000) {
         simpleloop(BENCHMARK_DB_DELETE_SPIN);
@@ -304,10 +475,18 @@ static void generic_work(uint32_t msw, uint32_t lsw, uint32_t msw_id,
         .src_port = id->dst_port,
         .dst_port = id->src_port};
 
+    uint64_t tx_start = rdtsc();
     ret = udp_send_one((void *)&resp, sizeof(struct message), &new_id);
+    tx_stats[cpu_nr_].send_cycles += rdtsc() - tx_start;
 
-    if (ret)
+    if (ret) {
         log_warn("udp_send failed with error %d\n", ret);
+    } else {
+        tx_stats[cpu_nr_].responses++;
+        /* The first response of a batch starts the tx_deadline clock. */
+        if (!tx_held_since)
+            tx_held_since = tx_start;
+    }
 
     finished = true;
     swapcontext_very_fast(cont, &uctx_main);
@@ -343,11 +522,16 @@ static inline void parse_packet(struct mbuf *pkt, void **data_ptr,
 
 static inline void init_worker(void)
 {
-    cpu_nr_ = percpu_get(cpu_nr) - 2;
+    cpu_nr_ = percpu_get(cpu_nr) - WORKER_CPU_BASE;
     active_req = 0;
-    for(int i = 0; i < JBSQ_LEN; i++){
-        worker_responses[cpu_nr_].responses[i].flag = PROCESSED;
-    }
+#if PREEMPT_TRACE == 1
+    ptrace_init_worker(cpu_nr_);
+#endif
+    worker_status[cpu_nr_].check = false;
+    worker_status[cpu_nr_].timestamp = MAX_UINT64;
+
+    tx_deadline_cycles = CFG.tx_deadline * CPU_FREQ_GHZ * 1000;
+    tx_held_since = 0;
 
     dune_register_intr_handler(PREEMPT_VECTOR, test_handler);
 
@@ -359,23 +543,19 @@ static inline void init_worker(void)
 static inline void handle_new_packet(void)
 {
     int ret;
+    uintptr_t *sp;
     void *data;
     struct ip_tuple *id;
-    struct mbuf *pkt = (struct mbuf *)dispatcher_requests[cpu_nr_].requests[active_req].req->mbufs[0];
+    struct request *req = dispatcher_requests[cpu_nr_].requests[active_req].req;
+    struct mbuf *pkt = (struct mbuf *)req->mbufs[0];
     parse_packet(pkt, &data, &id);
     if (data)
     {
-        uint32_t msw = ((uint64_t)data & 0xFFFFFFFF00000000) >> 32;
-        uint32_t lsw = (uint64_t)data & 0x00000000FFFFFFFF;
-        uint32_t msw_id = ((uint64_t)id & 0xFFFFFFFF00000000) >> 32;
-        uint32_t lsw_id = (uint64_t)id & 0x00000000FFFFFFFF;
         cont = dispatcher_requests[cpu_nr_].requests[active_req].rnbl;
-        getcontext_fast(cont);
-        set_context_link(cont, &uctx_main);
-        makecontext(cont, (void (*)(void))generic_work, 4, msw, lsw,
-                    msw_id, lsw_id);
+        sp = context_frame(cont, &uctx_main);
         finished = false;
-        ret = swapcontext_very_fast(&uctx_main, cont);
+        ret = context_start_fast(&uctx_main, sp, (void (*)(void))generic_work,
+                                 (uint64_t)req, (uint64_t)id);
         if (ret)
         {
             log_err("Failed to do swap into new context\n");
@@ -521,6 +701,7 @@ static void do_db_generic_work(struct db_req *db_pkg, uint64_t start_time)
 static inline void handle_fake_new_packet(void)
 {
     int ret;
+    uintptr_t *sp;
     struct mbuf *pkt;
     // struct custom_payload *req;
     struct db_req *req;
@@ -537,14 +718,12 @@ static inline void handle_fake_new_packet(void)
         return;
     }
 
-    cont = (struct mbuf *)dispatcher_requests[cpu_nr_].requests[active_req].rnbl;
-    getcontext_fast(cont);
-    set_context_link(cont, &uctx_main);
-
-    makecontext(cont, (void (*)(void))do_db_generic_work, 2, req, dispatcher_requests[cpu_nr_].requests[active_req].timestamp);
+    cont = dispatcher_requests[cpu_nr_].requests[active_req].rnbl;
+    sp = context_frame(cont, &uctx_main);
 
     finished = false;
-    ret = swapcontext_very_fast(&uctx_main, cont);
+    ret = context_start_fast(&uctx_main, sp, (void (*)(void))do_db_generic_work,
+                             (uint64_t)req, dispatcher_requests[cpu_nr_].requests[active_req].timestamp);
     if (ret)
     {
         log_err("Failed to do swap into new context\n");
@@ -558,7 +737,7 @@ static inline void handle_context(void)
     finished = false;
     cont = dispatcher_requests[cpu_nr_].requests[active_req].rnbl;
     set_context_link(cont, &uctx_main);
-    ret = swapcontext_fast(&uctx_main, cont);
+    ret = resume_context();
     if (ret)
     {
         log_err("Failed to swap to existing context\n");
@@ -566,20 +745,153 @@ static inline void handle_context(void)
     }
 }
 
-static inline void handle_request(void)
+#if WORKER_STEALING == 1
+/* Takes a task from the first peer, after us, that has one queued. */
+static inline int steal_task(struct task * tsk)
 {
+    int i, victim, nr_workers = CFG.num_cpus - WORKER_CPU_BASE;
+
+    for (i = 1; i < nr_workers; i++) {
+        victim = (cpu_nr_ + i) % nr_workers;
+        if (!local_deque_take(&local_deques[victim], tsk))
+            return 0;
+    }
+    return -1;
+}
+#endif
+
+/*
+ * Waits until the current slot holds a task. When stealing, the task comes
+ * from our local deque or a peer's and is copied into our own slot, which the
+ * dispatcher does not use in that mode.
+ */
+static inline void wait_for_request(void)
+{
+#if WORKER_STEALING == 1
+    struct task tsk;
+
+    while (local_deque_take(&local_deques[cpu_nr_], &tsk) && steal_task(&tsk));
+    dispatcher_requests[cpu_nr_].requests[active_req].rnbl = tsk.runnable;
+    dispatcher_requests[cpu_nr_].requests[active_req].req = tsk.req;
+    dispatcher_requests[cpu_nr_].requests[active_req].type = tsk.type;
+    dispatcher_requests[cpu_nr_].requests[active_req].category = tsk.category;
+    dispatcher_requests[cpu_nr_].requests[active_req].timestamp = tsk.timestamp;
+#else
     while (dispatcher_requests[cpu_nr_].requests[active_req].flag != READY);
-    preempt_check[cpu_nr_].timestamp = rdtsc();
-    preempt_check[cpu_nr_].check = true;
+#endif
+}
+
+/* Whether the next request for this worker is already there. */
+static inline bool worker_has_work(void)
+{
+#if WORKER_STEALING == 1
+    return local_deque_len(&local_deques[cpu_nr_]) != 0;
+#else
+    return dispatcher_requests[cpu_nr_].requests[active_req].flag == READY;
+#endif
+}
+
+/*
+ * Cycles the next request may run before it is back in the main loop: its
+ * time slice, or less if it is expected to finish sooner.
+ */
+static inline uint64_t next_run_cycles(void)
+{
+#if WORKER_STEALING == 1
+    struct local_deque *dq = &local_deques[cpu_nr_];
+    /* Only a guess, the task may be taken by a thief meanwhile. */
+    uint8_t type = dq->tasks[dq->head & LOCAL_DEQUE_MASK].type;
+
+    return worker_slices[cpu_nr_].slices[sched_port(type)];
+#else
+    struct request *req = dispatcher_requests[cpu_nr_].requests[active_req].req;
+    uint8_t type = dispatcher_requests[cpu_nr_].requests[active_req].type;
+    uint64_t slice = worker_slices[cpu_nr_].slices[sched_port(type)];
+    uint64_t left;
+
+    if (!req || req->size_hint <= req->service_ns)
+        return slice;
+    left = (req->size_hint - req->service_ns) * CPU_FREQ_GHZ;
+    return left < slice ? left : slice;
+#endif
+}
+
+/**
+ * worker_tx_poll - sends the responses held once a batch is due
+ *
+ * Rings the NIC doorbell only when there is something to send.
+ */
+static inline void worker_tx_poll(void)
+{
+    int i, held = 0;
+    uint64_t now;
+
+    for (i = 0; i < percpu_get(eth_num_queues); i++)
+        held += percpu_get(eth_txqs[i])->len;
+    if (!held)
+        return;
+
+    now = rdtsc();
+    /* Only generic_work() stamps what it queues, so date anything else now. */
+    if (!tx_held_since)
+        tx_held_since = now;
+    if (held < CFG.tx_batch && worker_has_work() &&
+        now - tx_held_since + next_run_cycles() < tx_deadline_cycles)
+        return;
+
+    eth_process_send();
+    tx_held_since = 0;
+    tx_stats[cpu_nr_].doorbells++;
+    tx_stats[cpu_nr_].flush_cycles += rdtsc() - now;
+}
+
+/*
+ * Lets the dispatcher preempt the request about to run. A flag it raised for
+ * the previous request, after that one already finished, is dropped first so
+ * it does not cut the new one short.
+ */
+static inline void arm_preemption(void)
+{
+    uint64_t now = rdtsc();
+
+    concord_preempt_now = 0;
+    concord_pending_yield = NULL;
+#if SCHEDULE_METHOD == METHOD_RDTSC
+    /* Checked by the rdtsc probes, which yield through concord_rdtsc_func(). */
+    concord_start_time = now;
+    concord_preempt_after_cycle = worker_slices[cpu_nr_].slices[sched_port(worker_status[cpu_nr_].type)];
+#endif
+    worker_status[cpu_nr_].timestamp = now;
+    barrier();
+    worker_status[cpu_nr_].check = true;
+}
+
+/*
+ * Called once the request switched back to us. The dispatcher may have raised
+ * the flag after the request's last probe; no IPI should follow it.
+ */
+static inline void disarm_preemption(void)
+{
+    worker_status[cpu_nr_].check = false;
+    concord_preempt_now = 0;
+}
+
+static inline void handle_request(void)
+{
+    wait_for_request();
+    fpu_save = type_fpu_save(dispatcher_requests[cpu_nr_].requests[active_req].type);
+    worker_status[cpu_nr_].type = dispatcher_requests[cpu_nr_].requests[active_req].type;
+    arm_preemption();
     if (dispatcher_requests[cpu_nr_].requests[active_req].category == PACKET)
         handle_new_packet();
     else
         handle_context();
+    disarm_preemption();
 }
 
 static inline void handle_fake_request(void)
 {
-    while (dispatcher_requests[cpu_nr_].requests[active_req].flag != READY);
+    wait_for_request();
     /* Turn on to debug time lost in waiting for new req */
     // if(likely(IS_FIRST_PACKET)){
     //     if(cpu_nr_ == MAGIC_CPU){
@@ -589,8 +901,9 @@ static inline void handle_fake_request(void)
     // if(cpu_nr_ == MAGIC_CPU)
     //     idle_timestamps[idle_timestamp_iterator].start_req = rdtsc();
 
-    preempt_check[cpu_nr_].timestamp = rdtsc();
-    preempt_check[cpu_nr_].check = true;
+    fpu_save = type_fpu_save(dispatcher_requests[cpu_nr_].requests[active_req].type);
+    worker_status[cpu_nr_].type = dispatcher_requests[cpu_nr_].requests[active_req].type;
+    arm_preemption();
     if (dispatcher_requests[cpu_nr_].requests[active_req].category == PACKET)
     {
         if (unlikely(!IS_FIRST_PACKET))
@@ -608,7 +921,7 @@ static inline void handle_fake_request(void)
     // if(cpu_nr_ == MAGIC_CPU)
     //     idle_timestamps[idle_timestamp_iterator].after_ctx = rdtsc();
 
-    preempt_check[cpu_nr_].check = false;
+    disarm_preemption();
 }
 
 static inline void finish_request(void)
@@ -618,21 +931,133 @@ static inline void finish_request(void)
     worker_responses[cpu_nr_].responses[active_req].req = dispatcher_requests[cpu_nr_].requests[active_req].req;
     worker_responses[cpu_nr_].responses[active_req].rnbl = cont;
     worker_responses[cpu_nr_].responses[active_req].category = CONTEXT;
-    if (finished)
-    {
-        worker_responses[cpu_nr_].responses[active_req].flag = FINISHED;
-    }
-    else
-    {
-        worker_responses[cpu_nr_].responses[active_req].flag = PREEMPTED;
-    }
+    /* Used by the SRPT policy and the adaptive time slice in the dispatcher. */
+    struct request * req = dispatcher_requests[cpu_nr_].requests[active_req].req;
+    if (likely(req))
+        req->service_ns += (rdtsc() - worker_status[cpu_nr_].timestamp) / CPU_FREQ_GHZ;
+    barrier();
+#if WORKER_STEALING == 1
+    local_results_push(&local_results[cpu_nr_], cont, req,
+                       dispatcher_requests[cpu_nr_].requests[active_req].type,
+                       dispatcher_requests[cpu_nr_].requests[active_req].timestamp,
+                       finished ? FINISHED : PREEMPTED);
+#else
     dispatcher_requests[cpu_nr_].requests[active_req].flag = DONE;
+    /* Publishing the flag hands the slot back, so it must come last. */
+    worker_status[cpu_nr_].flags[active_req] =
+        jbsq_flag_next(worker_status[cpu_nr_].flags[active_req],
+                       finished ? FINISHED : PREEMPTED);
+#endif
 
     /* Turn on to debug time lost in waiting for new req */
     // if(cpu_nr_ == MAGIC_CPU)
     //     idle_timestamps[idle_timestamp_iterator].after_response = rdtsc();
 }
 
+#if CONTEXT_SWITCH_BENCH == 1
+#define BENCH_SWITCHES      100000
+#define BENCH_WARMUP        1000
+
+static struct {
+    ucontext_t uc;
+    struct xstate xs;
+} bench_cont;
+static char bench_stack[16384] __attribute__((aligned(16)));
+static uint8_t bench_dirty;
+
+/* Yields right away, with the AVX upper halves in use or in init state. */
+static void bench_context_loop(void)
+{
+    while (true) {
+        if (xstate_mask & XSTATE_AVX) {
+            if (bench_dirty)
+                asm volatile("vpcmpeqd %%ymm15, %%ymm15, %%ymm15" ::: "xmm15");
+            else
+                asm volatile("vzeroupper");
+        }
+        yield_to_control();
+    }
+}
+
+/*
+ * bench_context_switch - reports the cycles of a preempt and resume round
+ * trip for each fpu_save mode. Interrupts are off, so nothing else runs.
+ */
+static void bench_context_switch(void)
+{
+    int mode, dirty, i;
+    uint64_t start, cycles;
+
+    cont = &bench_cont.uc;
+    getcontext_fast(cont);
+    cont->uc_stack.ss_sp = bench_stack;
+    cont->uc_stack.ss_size = sizeof(bench_stack);
+    cont->uc_link = NULL;
+    makecontext(cont, bench_context_loop, 0);
+    fpu_save = FPU_SAVE_NONE;
+    swapcontext_very_fast(&uctx_main, cont);
+
+    for (mode = FPU_SAVE_NONE; mode <= FPU_SAVE_XSAVE; mode++) {
+        if (mode == FPU_SAVE_XSAVE && !xstate_mask)
+            continue;
+        for (dirty = 0; dirty < ((xstate_mask & XSTATE_AVX) ? 2 : 1); dirty++) {
+            fpu_save = mode;
+            bench_dirty = dirty;
+            for (i = 0; i < BENCH_WARMUP; i++)
+                resume_context();
+            start = rdtsc();
+            for (i = 0; i < BENCH_SWITCHES; i++)
+                resume_context();
+            cycles = rdtsc() - start;
+            log_info("Context switch - fpu_save %s, avx %s: %llu cycles per round trip\n",
+                     fpu_save_names[mode], dirty ? "dirty" : "clean",
+                     cycles / BENCH_SWITCHES);
+        }
+    }
+    cont = NULL;
+}
+
+static void bench_start_entry(uint64_t arg0, uint64_t arg1)
+{
+    swapcontext_very_fast(cont, &uctx_main);
+}
+
+/*
+ * bench_context_start - reports the cycles to start a request and get back
+ * control, with makecontext as before and with context_start_fast.
+ */
+static void bench_context_start(void)
+{
+    int i;
+    uintptr_t *sp;
+    uint64_t start, slow, fast;
+
+    cont = &bench_cont.uc;
+    cont->uc_stack.ss_sp = bench_stack;
+    cont->uc_stack.ss_size = sizeof(bench_stack);
+
+    start = rdtsc();
+    for (i = 0; i < BENCH_SWITCHES; i++) {
+        getcontext_fast(cont);
+        set_context_link(cont, &uctx_main);
+        makecontext(cont, (void (*)(void))bench_start_entry, 2, 0UL, 0UL);
+        swapcontext_very_fast(&uctx_main, cont);
+    }
+    slow = (rdtsc() - start) / BENCH_SWITCHES;
+
+    start = rdtsc();
+    for (i = 0; i < BENCH_SWITCHES; i++) {
+        sp = context_frame(cont, &uctx_main);
+        context_start_fast(&uctx_main, sp, (void (*)(void))bench_start_entry, 0, 0);
+    }
+    fast = (rdtsc() - start) / BENCH_SWITCHES;
+
+    log_info("Context start - makecontext: %llu cycles, fast: %llu cycles, saved %lld per request\n",
+             slow, fast, (long long) (slow - fast));
+    cont = NULL;
+}
+#endif
+
 void do_work(void)
 {
     init_worker();
@@ -647,6 +1072,12 @@ void do_work(void)
     log_info("Worker %d started with tid %d\n", cpu_nr_, worker_tid);
 
     cpu_preempt_points[cpu_nr_] = &concord_preempt_now;
+#if CONTEXT_SWITCH_BENCH == 1
+    if (cpu_nr_ == 0) {
+        bench_context_switch();
+        bench_context_start();
+    }
+#endif
     while(!INIT_FINISHED);
     while (true)
     {
@@ -656,7 +1087,7 @@ void do_work(void)
 #else
 
         eth_process_reclaim();
-        eth_process_send();
+        worker_tx_poll();
         handle_request();
 #endif
         finish_request();
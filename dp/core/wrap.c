@@ -1,51 +1,292 @@
+/*
+ * wrap.c - the allocator behind malloc, free, calloc and realloc
+ *
+ * The binary is linked with -wrap for each of them, so LevelDB and the
+ * plugins allocate from here. Blocks up to WRAP_MAX_SIZE come from one
+ * power-of-two size class each. Every class owns a range of 2MB pages,
+ * carved into blocks as they are first needed, and keeps its free blocks in
+ * small per-thread caches in front of a locked free list. Anything larger,
+ * and everything before wrap_init(), goes to the libc allocator.
+ *
+ * Each call raises concord_lock_counter, as concord_enable() does, so a
+ * preemption that arrives meanwhile, by IPI or by probe, is taken when the
+ * call returns rather than with a cache or a class lock half updated. A
+ * block may be freed on another thread than the one that allocated it; it
+ * simply joins that thread's cache.
+ */
+
 #include <stdio.h>
 #include <malloc.h>
 #include <dlfcn.h>
 #include <stdlib.h>
-#include <ix/hijack.h>
+#include <string.h>
+
+#include <ix/stddef.h>
+#include <ix/errno.h>
+#include <ix/lock.h>
+#include <ix/log.h>
+#include <ix/page.h>
+
+/* Block sizes are 1 << (class + WRAP_MIN_SHIFT), from 16 bytes to 2KB. */
+#define WRAP_MIN_SHIFT      4
+#define WRAP_NR_CLASSES     8
+#define WRAP_MAX_SIZE       (1UL << (WRAP_MIN_SHIFT + WRAP_NR_CLASSES - 1))
+/* Address range of each class, a multiple of 2MB. */
+#define WRAP_CLASS_SPAN     (16UL << 20)
+/* Blocks a thread caches per class, and moves at once to or from the list. */
+#define WRAP_CACHE_MAX      64
+#define WRAP_BATCH          32
+
+struct wrap_block {
+    struct wrap_block *next;
+};
 
-__thread volatile uint8_t clear_ints = 0;
+struct wrap_class {
+    spinlock_t lock;
+    struct wrap_block *free;
+    uintptr_t brk;
+    uintptr_t end;
+} __aligned(64);
+
+struct wrap_cache {
+    struct wrap_block *free;
+    int cnt;
+};
+
+static struct wrap_class wrap_classes[WRAP_NR_CLASSES];
+static __thread struct wrap_cache wrap_caches[WRAP_NR_CLASSES];
+/* Start of the class ranges, 0 until wrap_init(). */
+static uintptr_t wrap_base;
+
+extern __thread int concord_lock_counter;
+extern __thread void (*concord_pending_yield)(void);
+
+/*
+ * Like concord_enable() and concord_disable(), without the lock hold events
+ * of PREEMPT_TRACE: the allocator runs far too often for its calls to be
+ * traced as locks.
+ */
+static inline void wrap_enter(void)
+{
+    concord_lock_counter++;
+    barrier();
+}
+
+static inline void wrap_leave(void)
+{
+    void (*yield)(void);
+
+    barrier();
+    if (--concord_lock_counter != 0)
+        return;
+    yield = concord_pending_yield;
+    if (unlikely(yield)) {
+        concord_pending_yield = NULL;
+        yield();
+    }
+}
 
 void* __real_malloc(size_t size);
 void __real_free(void * ptr);
 void* __real_calloc(size_t nmemb, size_t size);
 void* __real_realloc(void *ptr, size_t size);
 
+static inline int wrap_size_class(size_t size)
+{
+    if (size <= (1UL << WRAP_MIN_SHIFT))
+        return 0;
+    return 64 - __builtin_clzl(size - 1) - WRAP_MIN_SHIFT;
+}
+
+static inline bool wrap_owns(void *ptr)
+{
+    return wrap_base &&
+           (uintptr_t) ptr - wrap_base < WRAP_NR_CLASSES * WRAP_CLASS_SPAN;
+}
+
+static inline int wrap_ptr_class(void *ptr)
+{
+    return ((uintptr_t) ptr - wrap_base) / WRAP_CLASS_SPAN;
+}
+
+/* Moves up to WRAP_BATCH blocks of the class to the cache, then takes one. */
+static void *wrap_refill(struct wrap_cache *c, int cls)
+{
+    struct wrap_class *wc = &wrap_classes[cls];
+    size_t size = 1UL << (cls + WRAP_MIN_SHIFT);
+    struct wrap_block *b;
+    int n;
+
+    spin_lock(&wc->lock);
+    for (n = 0; n < WRAP_BATCH; n++) {
+        if (wc->free) {
+            b = wc->free;
+            wc->free = b->next;
+        } else if (wc->brk + size <= wc->end) {
+            b = (struct wrap_block *) wc->brk;
+            wc->brk += size;
+        } else {
+            break;
+        }
+        b->next = c->free;
+        c->free = b;
+    }
+    spin_unlock(&wc->lock);
+
+    if (unlikely(!n))
+        return NULL;
+    b = c->free;
+    c->free = b->next;
+    c->cnt += n - 1;
+    return b;
+}
+
+/* Gives the WRAP_BATCH most recently freed blocks back to the class. */
+static void wrap_drain(struct wrap_cache *c, int cls)
+{
+    struct wrap_class *wc = &wrap_classes[cls];
+    struct wrap_block *head = c->free, *tail = head;
+    int n;
+
+    for (n = 1; n < WRAP_BATCH; n++)
+        tail = tail->next;
+    c->free = tail->next;
+    c->cnt -= WRAP_BATCH;
+
+    spin_lock(&wc->lock);
+    tail->next = wc->free;
+    wc->free = head;
+    spin_unlock(&wc->lock);
+}
+
+static inline void *wrap_alloc(size_t size)
+{
+    struct wrap_cache *c;
+    struct wrap_block *b;
+    int cls;
+
+    if (unlikely(!wrap_base || size > WRAP_MAX_SIZE))
+        return __real_malloc(size);
+
+    cls = wrap_size_class(size);
+    c = &wrap_caches[cls];
+    b = c->free;
+    if (likely(b)) {
+        c->free = b->next;
+        c->cnt--;
+        return b;
+    }
+
+    b = wrap_refill(c, cls);
+    return b ? b : __real_malloc(size);
+}
+
+static inline void wrap_release(void *ptr)
+{
+    struct wrap_cache *c;
+    struct wrap_block *b = ptr;
+    int cls;
+
+    if (!wrap_owns(ptr)) {
+        __real_free(ptr);
+        return;
+    }
+
+    cls = wrap_ptr_class(ptr);
+    c = &wrap_caches[cls];
+    b->next = c->free;
+    c->free = b;
+    if (++c->cnt > WRAP_CACHE_MAX)
+        wrap_drain(c, cls);
+}
+
+/**
+ * wrap_init - reserves the memory of the small size classes
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int wrap_init(void)
+{
+    int cls;
+    uintptr_t base;
+
+    base = (uintptr_t) page_alloc_contig(WRAP_NR_CLASSES * WRAP_CLASS_SPAN /
+                                         PGSIZE_2MB);
+    if (!base)
+        return -ENOMEM;
+
+    for (cls = 0; cls < WRAP_NR_CLASSES; cls++) {
+        spin_lock_init(&wrap_classes[cls].lock);
+        wrap_classes[cls].free = NULL;
+        wrap_classes[cls].brk = base + cls * WRAP_CLASS_SPAN;
+        wrap_classes[cls].end = wrap_classes[cls].brk + WRAP_CLASS_SPAN;
+    }
+    wrap_base = base;
+
+    log_info("malloc: %d classes up to %lu bytes, %lu MB each\n",
+             WRAP_NR_CLASSES, WRAP_MAX_SIZE, WRAP_CLASS_SPAN >> 20);
+    return 0;
+}
+
 void *__wrap_malloc(size_t size)
 {
-    if (clear_ints)
-        asm volatile("cli":::);
-    void *p = __real_malloc(size);
-    if (clear_ints)
-        asm volatile("sti":::);
+    void *p;
+
+    wrap_enter();
+    p = wrap_alloc(size);
+    wrap_leave();
     return p;
 }
 
 void __wrap_free(void *ptr)
 {
-    if (clear_ints)
-        asm volatile("cli":::);
-    __real_free(ptr);
-    if (clear_ints)
-        asm volatile("sti":::);
+    wrap_enter();
+    wrap_release(ptr);
+    wrap_leave();
 }
 
 void *__wrap_calloc(size_t nmemb, size_t size)
 {
-    if (clear_ints)
-        asm volatile("cli":::);
-    void * foo = __real_calloc(nmemb, size);
-    if (clear_ints)
-        asm volatile("sti":::);
-    return foo;
+    void *p;
+    size_t total;
+
+    if (unlikely(__builtin_mul_overflow(nmemb, size, &total)))
+        return NULL;
+
+    wrap_enter();
+    if (!wrap_base || total > WRAP_MAX_SIZE) {
+        p = __real_calloc(nmemb, size);
+    } else {
+        p = wrap_alloc(total);
+        if (p)
+            memset(p, 0, total);
+    }
+    wrap_leave();
+    return p;
 }
 
 void *__wrap_realloc(void *ptr, size_t size)
 {
-    if (clear_ints)
-        asm volatile("cli":::);
-    void * foo = __real_realloc(ptr, size);
-    if (clear_ints)
-        asm volatile("sti":::);
-    return foo;
-}
\ No newline at end of file
+    void *p;
+    size_t old;
+
+    wrap_enter();
+    if (!ptr) {
+        p = wrap_alloc(size);
+    } else if (!wrap_owns(ptr)) {
+        p = __real_realloc(ptr, size);
+    } else {
+        old = 1UL << (wrap_ptr_class(ptr) + WRAP_MIN_SHIFT);
+        if (size <= old) {
+            p = ptr;
+        } else {
+            p = wrap_alloc(size);
+            if (p) {
+                memcpy(p, ptr, old);
+                wrap_release(ptr);
+            }
+        }
+    }
+    wrap_leave();
+    return p;
+}
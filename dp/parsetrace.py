@@ -0,0 +1,55 @@
+#!/usr/bin/python3
+
+# Summarizes the preemption trace written by a PREEMPT_TRACE=1 build.
+# Usage: parsetrace.py preempt_trace.bin [cpu_freq_ghz]
+
+import sys
+import os
+import numpy as np
+
+FLAG_SET, YIELD, DEFER, LOCK_HOLD = range(4)
+
+EVENT = np.dtype([('tsc', np.uint64), ('cycles', np.uint32),
+                  ('type', np.uint16), ('worker', np.uint16)])
+
+PERCENTILES = [50, 90, 99, 99.9]
+
+
+class Trace(object):
+    def __init__(self, fileName):
+        self.events = np.fromfile(fileName, dtype=EVENT)
+
+    def cycles(self, eventType, worker=None):
+        sel = self.events['type'] == eventType
+        if worker is not None:
+            sel &= self.events['worker'] == worker
+        return self.events['cycles'][sel]
+
+    def workers(self):
+        return np.unique(self.events['worker'])
+
+
+def printPcts(name, cycles, ghz):
+    if len(cycles) == 0:
+        print('%s: none' % name)
+        return
+    us = cycles / (ghz * 1e3)
+    pcts = ', '.join('p%s %.2f' % (p, np.percentile(us, p)) for p in PERCENTILES)
+    print('%s (us): count %d, mean %.2f, %s, max %.2f' %
+          (name, len(us), np.mean(us), pcts, np.max(us)))
+
+
+if __name__ == '__main__':
+    traceFile = sys.argv[1]
+    ghz = float(sys.argv[2]) if len(sys.argv) > 2 else 2.5
+    assert os.path.exists(traceFile)
+
+    trace = Trace(traceFile)
+    flags = len(trace.cycles(FLAG_SET))
+    defers = len(trace.cycles(DEFER))
+    print('flags seen %d, deferred by a lock %d' % (flags, defers))
+    printPcts('Preemption lateness', trace.cycles(YIELD), ghz)
+    printPcts('Deferral lateness', trace.cycles(DEFER), ghz)
+    printPcts('Lock hold time', trace.cycles(LOCK_HOLD), ghz)
+    for w in trace.workers():
+        printPcts('Worker %d preemption lateness' % w, trace.cycles(YIELD, w), ghz)
@@ -71,6 +71,16 @@ static inline unsigned long rdtscp(unsigned int *aux)
 	return ((unsigned long) a) | (((unsigned long) d) << 32);
 }
 
+#define X86_EFLAGS_IF	0x200	/* interrupts enabled */
+
+static inline unsigned long read_rflags(void)
+{
+	unsigned long flags;
+
+	asm volatile("pushfq; popq %0" : "=r"(flags) : : "memory");
+	return flags;
+}
+
 static inline unsigned long rdmsr(unsigned int msr)
 {
 	unsigned low, high;
@@ -35,6 +35,40 @@
 #define CFG_MAX_CPU     128
 #define CFG_MAX_ETHDEV   16
 
+/* Dispatcher scheduling policies, selected with sched_policy= */
+#define SCHED_FCFS       0
+#define SCHED_SLO        1
+#define SCHED_SRPT       2
+#define SCHED_EDF        3
+
+/* Number of dispatch priority classes, selected per port with priority= */
+#define SCHED_MAX_CLASSES 4
+
+/* Extended state saved on preemption, selected per port with fpu_save= */
+#define FPU_SAVE_NONE    0
+#define FPU_SAVE_ENV     1
+#define FPU_SAVE_XSAVE   2
+
+/* Request stack size classes, selected per port with stack_size= */
+#define STACK_CLASS_4KB  0
+#define STACK_CLASS_16KB 1
+#define STACK_CLASS_64KB 2
+#define STACK_NR_CLASSES 3
+
+/* Default time a worker gets to reach a probe before the IPI, in ns */
+#define PREEMPT_GRACE_DEFAULT 2000
+
+/* Default time a networker waits for the rest of a request, in us */
+#define REASSEMBLY_TIMEOUT_DEFAULT 1000
+
+/* Default responses a worker batches, and how long it holds them, in us */
+#define TX_BATCH_DEFAULT 16
+#define TX_BATCH_MAX 256
+#define TX_DEADLINE_DEFAULT 10
+
+/* Default library with the rdtsc probes, for requests run by the dispatcher */
+#define PLUGIN_PATH_DEFAULT "../benchmarks/leveldb/lib/concord_apileveldb_rdtsc.so"
+
 
 struct cfg_ip_addr {
 	uint32_t addr;
@@ -58,12 +92,36 @@ struct cfg_parameters {
 	uint16_t ports[CFG_MAX_PORTS];
 
 	int num_slos;
-	float slos[CFG_MAX_PORTS];
+	uint32_t slos[CFG_MAX_PORTS];		/* in ns, as configured */
+	uint64_t slo_cycles[CFG_MAX_PORTS];	/* the same in TSC cycles */
+
+	int num_quanta;
+	uint32_t quanta[CFG_MAX_PORTS];
+
+	int num_prios;
+	uint8_t prios[CFG_MAX_PORTS];
+	int sched_classes;
+
+	int sched_policy;
+
+	int num_fpu_saves;
+	uint8_t fpu_saves[CFG_MAX_PORTS];
+
+	int num_stack_sizes;
+	uint8_t stack_sizes[CFG_MAX_PORTS];
+
+	uint32_t preempt_grace;
+	uint32_t reassembly_timeout;
+	uint32_t tx_batch;
+	uint32_t tx_deadline;
 
 	char loader_path[256];
+	char plugin_path[256];
 };
 
 extern struct cfg_parameters CFG;
+/* fpu_save= values indexed by FPU_SAVE_*, NULL-terminated. */
+extern const char *fpu_save_names[];
 
 
 
@@ -30,6 +30,7 @@
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 #define unreachable() __builtin_unreachable()
+#define barrier() asm volatile("" ::: "memory")
 
 #define prefetch0(x) __builtin_prefetch((x), 0, 3)
 #define prefetch1(x) __builtin_prefetch((x), 0, 2)
@@ -38,6 +39,7 @@
 #define prefetch() prefetch0()
 
 #define clz64(x) __builtin_clzll(x)
+#define ctz64(x) __builtin_ctzll(x)
 
 #define __packed __attribute__((packed))
 #define __notused __attribute__((unused))
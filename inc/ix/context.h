@@ -30,45 +30,178 @@
 #include <ucontext.h>
 
 #include <ix/mempool.h>
+#include <ix/stack.h>
+#include <ix/stddef.h>
 
-struct mempool_datastore context_datastore;
-struct mempool context_pool __attribute((aligned(64)));
-struct mempool_datastore stack_datastore;
-struct mempool stack_pool __attribute((aligned(64)));
+struct mempool_datastore context_datastores[STACK_MAX_NODES];
+DECLARE_PERCPU(struct mempool, context_pools[STACK_MAX_NODES]);
 
 extern int getcontext_fast(ucontext_t *ucp);
+extern int context_start_fast(ucontext_t *ouctx, uintptr_t *sp, void (*fn)(void),
+                              uint64_t arg0, uint64_t arg1);
+extern void context_trampoline(void);
+
+/*
+ * XSAVE state components switched lazily for fpu_save="xsave" request types.
+ * Later components (AVX-512 and up) are left alone.
+ */
+#define XSTATE_SSE          (1UL << 1)
+#define XSTATE_AVX          (1UL << 2)
+
+/* Legacy region, XSAVE header and the AVX component, standard format. */
+#define XSAVE_AREA_SIZE     832
+#define XSAVE_MXCSR_OFFSET  24
+#define XSAVE_HDR_OFFSET    512
+
+/*
+ * Per-context save area, placed right after the ucontext_t in the context
+ * element. Only reserved when some request type uses fpu_save="xsave".
+ * The element memory starts zeroed and only XSTATE_BV in the header is ever
+ * written, so the header stays valid for XRSTOR.
+ */
+struct xstate {
+    uint64_t saved;
+    uint8_t buf[XSAVE_AREA_SIZE + 63];
+};
+
+/* Components the OS enabled in XCR0, out of XSTATE_SSE | XSTATE_AVX. */
+extern uint64_t xstate_mask;
+
+static inline struct xstate *context_xstate(ucontext_t *c)
+{
+    return (struct xstate *) (c + 1);
+}
+
+static inline uint64_t xgetbv(uint32_t index)
+{
+    uint32_t lo, hi;
+
+    asm volatile("xgetbv" : "=a" (lo), "=d" (hi) : "c" (index));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+/**
+ * xstate_save - saves the SSE/AVX state of the running context if in use
+ * @xs: the context's save area
+ *
+ * XGETBV with ECX=1 returns XINUSE, the components not in their initial
+ * state; when none of ours is, only the header and MXCSR are written, so a
+ * later XRSTOR puts the registers back in init state. XSAVEOPT also skips
+ * the components not modified since they were last restored from this area.
+ */
+static inline void xstate_save(struct xstate *xs)
+{
+    uint64_t in_use = xgetbv(1) & xstate_mask;
+    uint8_t *area = (uint8_t *) align_up((uintptr_t) xs->buf, 64);
+
+    xs->saved = in_use;
+    if (in_use) {
+        asm volatile("xsaveopt64 (%0)" : : "r" (area), "a" ((uint32_t) xstate_mask),
+                     "d" ((uint32_t) (xstate_mask >> 32)) : "memory");
+    } else {
+        *(uint64_t *) (area + XSAVE_HDR_OFFSET) &= ~xstate_mask;
+        asm volatile("stmxcsr %0" : "=m" (*(uint32_t *) (area + XSAVE_MXCSR_OFFSET)));
+    }
+}
+
+/**
+ * xstate_restore - restores the state saved by xstate_save
+ * @xs: the context's save area
+ *
+ * Nothing is loaded when the context had no state in use and the registers
+ * are still in init state.
+ */
+static inline void xstate_restore(struct xstate *xs)
+{
+    uint8_t *area = (uint8_t *) align_up((uintptr_t) xs->buf, 64);
+
+    if (xs->saved || (xgetbv(1) & xstate_mask))
+        asm volatile("xrstor64 (%0)" : : "r" (area), "a" ((uint32_t) xstate_mask),
+                     "d" ((uint32_t) (xstate_mask >> 32)) : "memory");
+}
 
 /**
  * context_alloc - allocates a ucontext_t and its stack
  * @cont: pointer to the pointer of the allocated context
+ * @type: the request type, which picks the stack size class
+ * @node: the NUMA node to allocate on, when it has memory left
  *
  * Returns 0 on success, -1 if failure.
  */
-static inline int context_alloc(ucontext_t ** cont)
+static inline int context_alloc(ucontext_t ** cont, uint8_t type, int node)
 {
-    (*cont) = mempool_alloc(&context_pool);
-    if (unlikely(!(*cont)))
+    int i, cls = stack_type_class(type);
+    void * stack = NULL;
+
+    for (i = 0; i < STACK_MAX_NODES && !stack; i++) {
+        stack = stack_alloc(cls, node);
+        if (!stack)
+            node = (node + 1) % STACK_MAX_NODES;
+    }
+    if (unlikely(!stack))
         return -1;
 
-    void * stack = mempool_alloc(&stack_pool);
-    if (unlikely(!stack)) {
-        mempool_free(&context_pool, (*cont));
+    (*cont) = mempool_alloc(&percpu_get(context_pools)[node]);
+    if (unlikely(!(*cont))) {
+        stack_free(stack, type);
         return -1;
     }
 
     (*cont)->uc_stack.ss_sp = stack;
-    (*cont)->uc_stack.ss_size = sizeof(stack);
+    (*cont)->uc_stack.ss_size = stack_size(cls);
     return 0;
 }
 
 /**
  * context_free - frees a context and the associated stack
  * @c: the context
+ * @type: the request type the context ran
+ *
+ * Both go back to the pools of the node they came from.
  */
-static inline void context_free(ucontext_t *c)
+static inline void context_free(ucontext_t *c, uint8_t type)
 {
-    mempool_free(&stack_pool, c->uc_stack.ss_sp);
-    mempool_free(&context_pool, c);
+    int node = stack_node(c->uc_stack.ss_sp);
+
+    stack_free(c->uc_stack.ss_sp, type);
+    mempool_free(&percpu_get(context_pools)[node], c);
+}
+
+/**
+ * context_place - moves a context that has not run yet to a NUMA node
+ * @c: the context
+ * @type: the request type
+ * @node: the node of the worker about to run it
+ *
+ * A context that already ran keeps its stack, since the stack may hold
+ * pointers to itself.
+ *
+ * Returns the context to run, @c itself when it is already on @node or the
+ * node has no memory left.
+ */
+static inline ucontext_t *context_place(ucontext_t *c, uint8_t type, int node)
+{
+    int cls;
+    void *stack;
+    ucontext_t *moved;
+
+    if (likely(stack_node(c->uc_stack.ss_sp) == node))
+        return c;
+
+    cls = stack_type_class(type);
+    stack = stack_alloc(cls, node);
+    if (unlikely(!stack))
+        return c;
+    moved = mempool_alloc(&percpu_get(context_pools)[node]);
+    if (unlikely(!moved)) {
+        stack_free(stack, type);
+        return c;
+    }
+
+    moved->uc_stack.ss_sp = stack;
+    moved->uc_stack.ss_size = stack_size(cls);
+    context_free(c, type);
+    return moved;
 }
 
 /**
@@ -80,7 +213,7 @@ static inline void set_context_link(ucontext_t *c, ucontext_t *uc_link)
 {
     uintptr_t *sp;
     /* Set up the sp pointer so that we save uc_link in the correct address. */
-    sp = ((uintptr_t *) c->uc_stack.ss_sp + c->uc_stack.ss_size);
+    sp = (uintptr_t *) ((uintptr_t) c->uc_stack.ss_sp + c->uc_stack.ss_size);
     /* We assume that we have less than 6 arguments here. */
     sp -= 1;
     sp = (uintptr_t *) ((((uintptr_t) sp) & -16L) - 8);
@@ -88,3 +221,26 @@ static inline void set_context_link(ucontext_t *c, ucontext_t *uc_link)
     c->uc_link = uc_link;
     sp[1] = (uintptr_t) c->uc_link;
 }
+
+/**
+ * context_frame - builds the initial stack frame of a new context
+ * @c: the context
+ * @uc_link: the return context of c
+ *
+ * The frame holds context_trampoline as the return address of the entry
+ * function and uc_link right above it, at the slot set_context_link uses.
+ * Returns the stack pointer to hand to context_start_fast.
+ */
+static inline uintptr_t *context_frame(ucontext_t *c, ucontext_t *uc_link)
+{
+    uintptr_t *sp;
+
+    sp = (uintptr_t *) ((uintptr_t) c->uc_stack.ss_sp + c->uc_stack.ss_size);
+    sp -= 1;
+    sp = (uintptr_t *) ((((uintptr_t) sp) & -16L) - 8);
+
+    c->uc_link = uc_link;
+    sp[0] = (uintptr_t) context_trampoline;
+    sp[1] = (uintptr_t) uc_link;
+    return sp;
+}
@@ -26,14 +26,53 @@
 #include <stdio.h>
 
 #include <ix/cfg.h>
+#include <ix/compiler.h>
 #include <ix/mempool.h>
 #include <ix/ethqueue.h>
+#include <ix/handoff.h>
+#include <ix/timer.h>
 
 #include <net/ip.h>
 #include <net/udp.h>
 
 #define MAX_WORKERS   18
 
+/* The dispatcher tracks worker occupancy in 64-bit masks. */
+#if MAX_WORKERS > 64
+#error "MAX_WORKERS must not exceed 64"
+#endif
+
+#ifndef NUM_DISPATCHERS
+#define NUM_DISPATCHERS 1
+#endif
+#define MAX_DISPATCHERS 4
+
+#if NUM_DISPATCHERS > MAX_DISPATCHERS
+#error "NUM_DISPATCHERS must not exceed MAX_DISPATCHERS"
+#endif
+
+#ifndef NUM_NETWORKERS
+#define NUM_NETWORKERS 1
+#endif
+#define MAX_NETWORKERS 4
+
+#if NUM_NETWORKERS > MAX_NETWORKERS
+#error "NUM_NETWORKERS must not exceed MAX_NETWORKERS"
+#endif
+
+/*
+ * CPU layout: CFG.cpu[0] runs dispatcher 0 and CFG.cpu[1] networker 0.
+ * Dispatchers 1..NUM_DISPATCHERS-1 take the next entries, starting at
+ * DISPATCHER_CPU_BASE, networkers 1..NUM_NETWORKERS-1 the ones after them,
+ * starting at NETWORKER_CPU_BASE, and every remaining entry is a worker.
+ */
+#define DISPATCHER_CPU_BASE     2
+#define NETWORKER_CPU_BASE      (NUM_DISPATCHERS + 1)
+#define WORKER_CPU_BASE         (NUM_DISPATCHERS + NUM_NETWORKERS)
+
+/* Maximum number of tasks handed over by a single steal. */
+#define STEAL_BATCH     4
+
 #define INACTIVE    0x00
 #define READY       0x01
 #define DONE        0x02 
@@ -41,7 +80,6 @@
 #define RUNNING     0x00
 #define FINISHED    0x01
 #define PREEMPTED   0x02
-#define PROCESSED   0x03
 
 // Dispatcher job states
 #define IDLE 0
@@ -59,23 +97,55 @@
 
 extern int req_offset;
 
-struct mempool_datastore task_datastore;
-struct mempool task_mempool __attribute((aligned(64)));
 struct mempool_datastore fini_request_cell_datastore;
-struct mempool fini_request_cell_mempool __attribute((aligned(64)));
+DECLARE_PERCPU(struct mempool, fini_request_cell_mempool);
 struct mempool_datastore request_datastore;
-struct mempool request_mempool __attribute((aligned(64)));
+DECLARE_PERCPU(struct mempool, request_mempool);
 struct mempool_datastore rq_datastore;
-struct mempool rq_mempool __attribute((aligned(64)));
+DECLARE_PERCPU(struct mempool, rq_mempool);
+struct mempool_datastore request_overflow_datastore;
+DECLARE_PERCPU(struct mempool, request_overflow_mempool);
 
+/*
+ * Depth of the per-worker JBSQ (join-bounded-shortest-queue) slots. It must be
+ * a power of two so that advancing a slot index is a mask, which the compiler
+ * folds to a no-op for depth 1 and to an xor for depth 2.
+ */
+#ifndef JBSQ_LEN
 #define JBSQ_LEN    0x02
+#endif
+
+#if JBSQ_LEN < 1 || JBSQ_LEN > 8 || (JBSQ_LEN & (JBSQ_LEN - 1))
+#error "JBSQ_LEN must be a power of two between 1 and 8"
+#endif
+
+#define JBSQ_MASK   (JBSQ_LEN - 1)
 
-#if JBSQ_LEN == 0x02
 static inline void jbsq_get_next(uint8_t* iter){
-        *iter =  *iter^1; // This is for JBSQ_LEN = 2
+        *iter = (*iter + 1) & JBSQ_MASK;
 }
-#elif JBSQ_LEN == 0x01
-static inline void jbsq_get_next(uint8_t* iter){}
+
+/*
+ * With WORKER_STEALING=1 the dispatcher does not hand tasks to JBSQ slots.
+ * It tops up a per-worker local deque in bulk instead, and a worker whose
+ * deque is empty takes tasks from its peers' deques. Finished and preempted
+ * tasks come back through a per-worker results ring.
+ */
+#ifndef WORKER_STEALING
+#define WORKER_STEALING 0
+#endif
+
+#define LOCAL_DEQUE_LEN     16
+#define LOCAL_DEQUE_MASK    (LOCAL_DEQUE_LEN - 1)
+#define LOCAL_DEQUE_FILL    4       /* tasks kept queued on every worker */
+#define LOCAL_RESULTS_LEN   64
+#define LOCAL_RESULTS_MASK  (LOCAL_RESULTS_LEN - 1)
+
+/* Most tasks a worker can hold at once, counting the one it runs. */
+#if WORKER_STEALING == 1
+#define WORKER_INFLIGHT     (LOCAL_DEQUE_FILL + 1)
+#else
+#define WORKER_INFLIGHT     JBSQ_LEN
 #endif
 
 struct message {
@@ -89,38 +159,87 @@ struct message {
         uint64_t genNs;
 } __attribute__((__packed__));
 
+/*
+ * A request holds its first REQUEST_INLINE_PKTS packets itself and the rest,
+ * up to REQUEST_MAX_PKTS, in an overflow block. Use request_get_mbuf() and
+ * request_set_mbuf() for any packet past the first.
+ */
+#define REQUEST_INLINE_PKTS     8
+#define REQUEST_MAX_PKTS        64
+
+struct request_overflow {
+	void * mbufs[REQUEST_MAX_PKTS - REQUEST_INLINE_PKTS];
+};
+
 struct request
 {
 	uint32_t pkts_length;
 	uint16_t type;
-	void * mbufs[8];
+	uint8_t networker;      /* whose per-cpu mempools it came from */
+	uint64_t size_hint;     /* expected service time in ns, from runNs */
+	uint64_t service_ns;    /* service received before being preempted */
+	void * mbufs[REQUEST_INLINE_PKTS];
+	struct request_overflow * overflow;   /* NULL if all packets fit inline */
 } __attribute__((packed, aligned(64)));
 
+static inline void * request_get_mbuf(struct request * req, uint32_t i)
+{
+	if (i < REQUEST_INLINE_PKTS)
+		return req->mbufs[i];
+	return req->overflow->mbufs[i - REQUEST_INLINE_PKTS];
+}
+
+static inline void request_set_mbuf(struct request * req, uint32_t i, void * pkt)
+{
+	if (i < REQUEST_INLINE_PKTS)
+		req->mbufs[i] = pkt;
+	else
+		req->overflow->mbufs[i - REQUEST_INLINE_PKTS] = pkt;
+}
+
+struct request_queue;
+
+/* A request still missing packets, dropped if they do not all come in time. */
 struct request_cell
 {
-	uint8_t pkts_remaining;
-	uint16_t client_id;
 	uint32_t req_id;
+	uint16_t client_id;
+	uint16_t pkts_remaining;
 	struct request * req;
-	struct request_cell * next;
-	struct request_cell * prev;
-} __attribute__((packed, aligned(64)));
+	struct request_queue * rq;
+	struct timer timer;
+} __attribute__((aligned(64)));
 
-struct request_queue {
-        struct request_cell * head;
+/*
+ * Requests in reassembly on one networker, in an open addressing table with
+ * linear probing keyed by (client_id, req_id). The table is never filled
+ * past RQ_TABLE_MAX_LOAD, so a lookup ends after a few probes, and first
+ * packets of new requests are dropped while it is that full.
+ */
+#define RQ_TABLE_SHIFT          12
+#define RQ_TABLE_SIZE           (1 << RQ_TABLE_SHIFT)
+#define RQ_TABLE_MASK           (RQ_TABLE_SIZE - 1)
+#define RQ_TABLE_MAX_LOAD       (RQ_TABLE_SIZE * 3 / 4)
+
+struct rq_slot {
+	uint32_t req_id;
+	uint16_t client_id;
+	struct request_cell * cell;     /* NULL if the slot is free */
 };
 
-struct request_queue rqueue;
+struct request_queue {
+	uint32_t count;
+	struct rq_slot slots[RQ_TABLE_SIZE];
+};
 
 struct worker_response
 {
-        uint64_t flag;
         void * rnbl;
         struct request * req;
         uint64_t timestamp;
         uint8_t type;
         uint8_t category;
-        char make_it_64_bytes[30];
+        char make_it_64_bytes[38];
 } __attribute__((packed, aligned(64)));
 
 struct jbsq_worker_response {
@@ -142,25 +261,93 @@ struct jbsq_dispatcher_request {
         struct dispatcher_request requests[JBSQ_LEN];
 }__attribute__((packed, aligned(64)));
 
-struct jbsq_preemption {
+/*
+ * Everything the dispatcher polls on a worker sits in this one line, written
+ * only by the worker: when and which request it started, whether it may
+ * still be preempted, and the flag of each JBSQ slot. The slot's
+ * worker_response is only read once its flag says there is something to take.
+ *
+ * The dispatcher never writes back: it keeps, in its own worker_state, the
+ * last flag it took from each slot and the run it already preempted.
+ */
+struct worker_status {
         uint64_t timestamp;
         uint8_t check;
-        char make_it_64_bytes[55]; 
-};__attribute__((packed, aligned(64)));
+        uint8_t type;   /* type of the request the worker is running */
+        uint8_t flags[JBSQ_LEN];
+        char make_it_64_bytes[54 - JBSQ_LEN];
+} __attribute__((packed, aligned(64)));
 
+/*
+ * Time slice of every port, in cycles, for the requests of a worker. Written
+ * by the worker's dispatcher, read by the worker at request start when it
+ * preempts itself (METHOD_RDTSC).
+ */
+struct worker_slices {
+        uint64_t slices[CFG_MAX_PORTS];
+} __attribute__((aligned(64)));
+
+/* How a worker's requests were preempted, mostly of use for METHOD_HYBRID. */
+struct preempt_counts {
+        uint64_t probe;   /* at a Concord probe or at lock release */
+        uint64_t ipi;     /* by a posted IPI */
+} __attribute__((aligned(64)));
+
+/* Responses a worker sent, and what sending them cost. */
+struct tx_stats {
+        uint64_t responses;
+        uint64_t doorbells;     /* eth_tx_xmit calls, one per batch */
+        uint64_t send_cycles;   /* building and queueing the responses */
+        uint64_t flush_cycles;  /* handing the batches to the NIC */
+} __attribute__((aligned(64)));
+
+/*
+ * A slot flag holds FINISHED or PREEMPTED in its low bits, and above them a
+ * count of the slot's results, so that each new result changes the flag.
+ */
+#define JBSQ_FLAG_STATE(flag)   ((flag) & 0x03)
+
+static inline uint8_t jbsq_flag_next(uint8_t flag, uint8_t state)
+{
+        return ((flag + 4) & ~0x03) | state;
+}
+
+/* Dispatcher-side state of a worker, never read by the worker. */
 struct worker_state {
         uint8_t next_push;
         uint8_t next_pop;
         uint8_t occupancy;
+        uint8_t taken[JBSQ_LEN];        /* last flag taken from each slot */
+        uint64_t preempted_run;         /* timestamp of the run preempted */
 } __attribute__((packed));
 
-struct networker_pointers_t
-{
+/*
+ * Handoff between one networker and one dispatcher: new requests flow on one
+ * ring, and the requests to free flow back on the other.
+ */
+struct networker_rings {
+        struct handoff_ring reqs;       /* networker to dispatcher */
+        struct handoff_ring frees;      /* dispatcher to networker */
+};
+
+/*
+ * Work stealing between dispatchers. A dispatcher with idle workers and an
+ * empty task queue claims a victim's steal_request slot; the victim answers by
+ * moving up to STEAL_BATCH of its surplus tasks into the thief's steal_batch.
+ */
+struct steal_request {
+        uint8_t thief;  /* id + 1 of the requesting dispatcher, 0 if none */
+        char make_it_64_bytes[63];
+} __attribute__((packed, aligned(64)));
+
+struct steal_batch {
+        uint8_t ready;
         uint8_t cnt;
-        uint8_t free_cnt;
-        uint8_t types[ETH_RX_MAX_BATCH];
-        struct request * reqs[ETH_RX_MAX_BATCH];
-        char make_it_64_bytes[64 - ETH_RX_MAX_BATCH*9 - 2];
+        uint8_t types[STEAL_BATCH];
+        uint8_t categories[STEAL_BATCH];
+        void * rnbls[STEAL_BATCH];
+        struct request * reqs[STEAL_BATCH];
+        uint64_t timestamps[STEAL_BATCH];
 } __attribute__((packed, aligned(64)));
 
 struct fini_request_cell {
@@ -172,7 +359,8 @@ struct fini_request_queue {
         struct fini_request_cell * head;
 };
 
-struct fini_request_queue frqueue;
+/* Requests to hand back, one queue per networker they came from. */
+extern __thread struct fini_request_queue frqueue[NUM_NETWORKERS];
 
 static inline struct request * request_dequeue(struct fini_request_queue * frq)
 {
@@ -184,7 +372,7 @@ static inline struct request * request_dequeue(struct fini_request_queue * frq)
 
         req = frq->head->req;
         tmp = frq->head;
-        mempool_free(&fini_request_cell_mempool, tmp);
+        mempool_free(&percpu_get(fini_request_cell_mempool), tmp);
         frq->head = frq->head->next;
 
         return req;
@@ -194,132 +382,268 @@ static inline void request_enqueue(struct fini_request_queue * frq, struct reque
 {
         if (unlikely(!req))
                 return;
-        struct fini_request_cell * frcell = mempool_alloc(&fini_request_cell_mempool);
+        struct fini_request_cell * frcell = mempool_alloc(&percpu_get(fini_request_cell_mempool));
         frcell->req = req;
         frcell->next = frq->head;
         frq->head = frcell;
 }
 
+/*
+ * The task queue keeps one power-of-two ring of inline task descriptors per
+ * category (PACKET and CONTEXT), indexed by free-running head and tail
+ * counters. Enqueueing and dequeueing only copy a 32-byte descriptor, so no
+ * allocation happens on the dispatcher's hot path.
+ *
+ * Every descriptor carries a sequence number taken at enqueue time. A plain
+ * dequeue picks whichever ring head is older, which keeps the FCFS order of a
+ * single queue, while a category-filtered dequeue is a single ring pop.
+ */
+#define TASK_QUEUE_SIZE         (1 << 16)
+#define TASK_QUEUE_MASK         (TASK_QUEUE_SIZE - 1)
+#define TASK_CATEGORIES         2
+
+/*
+ * Slots kept free for tasks that come back from the workers or from another
+ * dispatcher. New packets are only admitted below this watermark, so a
+ * preempted context always finds room in the queue.
+ */
+#define TASK_QUEUE_RESERVED     (MAX_WORKERS * WORKER_INFLIGHT + STEAL_BATCH)
+
 struct task {
         void * runnable;
         struct request * req;
+        uint64_t timestamp;
+        uint32_t seq;
         uint8_t type;
         uint8_t category;
-        uint64_t timestamp;
-        struct task * next;
+        char make_it_32_bytes[2];
+} __attribute__((packed, aligned(32)));
+
+struct task_ring
+{
+        uint32_t head;
+        uint32_t tail;
+        struct task * tasks;
 };
 
 struct task_queue
 {
-        struct task * head;
-        struct task * tail;
+        struct task_ring rings[TASK_CATEGORIES];
+        uint32_t head_seq;
+        uint32_t tail_seq;
 };
         
-struct task_queue tskq;
+extern int tskq_init(struct task_queue * tq);
 
-static inline void tskq_enqueue_head(struct task_queue * tq, void * rnbl,
-                                     struct request * req, uint8_t type,
-                                     uint8_t category, uint64_t timestamp)
+static inline struct task_ring * tskq_ring(struct task_queue * tq,
+                                           uint8_t category)
 {
-        struct task * tsk = mempool_alloc(&task_mempool);
-        tsk->runnable = rnbl;
-        tsk->req = req;
-        tsk->type = type;
-        tsk->category = category;
-        tsk->timestamp = timestamp;
-        if (tq->head != NULL) {
-            struct task * tmp = tq->head;
-            tq->head = tsk;
-            tsk->next = tmp;
-        } else {
-            tq->head = tsk;
-            tq->tail = tsk;
-            tsk->next = NULL;
-        }
+        return &tq->rings[category - PACKET];
 }
 
-static inline void tskq_enqueue_tail(struct task_queue * tq, void * rnbl,
-                                     struct request * req, uint8_t type,
-                                     uint8_t category, uint64_t timestamp)
+static inline uint32_t task_ring_len(struct task_ring * r)
+{
+        return r->tail - r->head;
+}
+
+static inline struct task * task_ring_head(struct task_ring * r)
+{
+        return &r->tasks[r->head & TASK_QUEUE_MASK];
+}
+
+static inline uint32_t tskq_len(struct task_queue * tq)
+{
+        return task_ring_len(&tq->rings[0]) + task_ring_len(&tq->rings[1]);
+}
+
+static inline int tskq_is_empty(struct task_queue * tq)
+{
+        return tskq_len(tq) == 0;
+}
+
+static inline int tskq_can_admit(struct task_queue * tq)
+{
+        return tskq_len(tq) < TASK_QUEUE_SIZE - TASK_QUEUE_RESERVED;
+}
+
+/**
+ * tskq_oldest - returns the ring whose head was enqueued first
+ * @tq: the task queue
+ *
+ * Returns NULL if the queue is empty.
+ */
+static inline struct task_ring * tskq_oldest(struct task_queue * tq)
+{
+        struct task_ring * p = &tq->rings[0];
+        struct task_ring * c = &tq->rings[1];
+
+        if (!task_ring_len(p))
+                return task_ring_len(c) ? c : NULL;
+        if (!task_ring_len(c))
+                return p;
+        return (int32_t)(task_ring_head(p)->seq - task_ring_head(c)->seq) < 0 ? p : c;
+}
+
+static inline void tskq_fill(struct task * tsk, void * rnbl,
+                             struct request * req, uint8_t type,
+                             uint8_t category, uint64_t timestamp,
+                             uint32_t seq)
 {
-        struct task * tsk = mempool_alloc(&task_mempool);
-        if (!tsk)
-                return;
         tsk->runnable = rnbl;
         tsk->req = req;
         tsk->type = type;
         tsk->category = category;
         tsk->timestamp = timestamp;
-        if (tq->head != NULL) {
-            tq->tail->next = tsk;
-            tq->tail = tsk;
-            tsk->next = NULL;
-        } else {
-            tq->head = tsk;
-            tq->tail = tsk;
-            tsk->next = NULL;
-        }
+        tsk->seq = seq;
+}
+
+static inline void tskq_read(struct task * tsk, void ** rnbl_ptr,
+                             struct request ** req, uint8_t *type,
+                             uint8_t *category, uint64_t *timestamp)
+{
+        (*rnbl_ptr) = tsk->runnable;
+        (*req) = tsk->req;
+        (*type) = tsk->type;
+        (*category) = tsk->category;
+        (*timestamp) = tsk->timestamp;
+}
+
+static inline int tskq_enqueue_head(struct task_queue * tq, void * rnbl,
+                                    struct request * req, uint8_t type,
+                                    uint8_t category, uint64_t timestamp)
+{
+        struct task_ring * r = tskq_ring(tq, category);
+
+        if (unlikely(task_ring_len(r) == TASK_QUEUE_SIZE))
+                return -1;
+        r->head--;
+        tskq_fill(task_ring_head(r), rnbl, req, type, category, timestamp,
+                  --tq->head_seq);
+        return 0;
+}
+
+static inline int tskq_enqueue_tail(struct task_queue * tq, void * rnbl,
+                                    struct request * req, uint8_t type,
+                                    uint8_t category, uint64_t timestamp)
+{
+        struct task_ring * r = tskq_ring(tq, category);
+
+        if (unlikely(task_ring_len(r) == TASK_QUEUE_SIZE))
+                return -1;
+        tskq_fill(&r->tasks[r->tail & TASK_QUEUE_MASK], rnbl, req, type,
+                  category, timestamp, tq->tail_seq++);
+        r->tail++;
+        return 0;
 }
 
 static inline int tskq_dequeue(struct task_queue * tq, void ** rnbl_ptr,
                                 struct request ** req, uint8_t *type, uint8_t *category,
                                 uint64_t *timestamp)
 {
-        if (tq->head == NULL)
+        struct task_ring * r = tskq_oldest(tq);
+
+        if (!r)
             return -1;
-        (*rnbl_ptr) = tq->head->runnable;
-        (*req) = tq->head->req;
-        (*type) = tq->head->type;
-        (*category) = tq->head->category;
-        (*timestamp) = tq->head->timestamp;
-        struct task * tsk = tq->head;
-        tq->head = tq->head->next;
-        mempool_free(&task_mempool, tsk);
-        if (tq->head == NULL)
-                tq->tail = NULL;
+        tskq_read(task_ring_head(r), rnbl_ptr, req, type, category, timestamp);
+        r->head++;
         return 0;
 }
 
 static inline int tskq_dequeue_category(struct task_queue * tq, void ** rnbl_ptr,
                                 struct request ** req, uint8_t *type, uint8_t *category,
                                 uint64_t *timestamp, uint8_t required_category){
-        struct task* curr = tq->head;
-        struct task* prev = NULL;
-        int found = 0;
-        while(curr != NULL){
-                if(curr->category == required_category){
-                        found = 1;
-                        break;
-                }
-                prev = curr;
-                curr = curr->next;
-        }
-        if(found){
-                (*rnbl_ptr) = curr->runnable;
-                (*req) = curr->req;
-                (*type) = curr->type;
-                (*category) = curr->category;
-                (*timestamp) = curr->timestamp;
-                struct task * tsk = prev;
-                if(curr == tq->head)
-                        tq->head = tq->head->next;
-                else
-                        prev->next = curr->next;
-
-                mempool_free(&task_mempool, curr);
-                if (tq->head == NULL)
-                        tq->tail = NULL;
-                return 0;
-        }     
-        return -1;
+        struct task_ring * r = tskq_ring(tq, required_category);
+
+        if (!task_ring_len(r))
+                return -1;
+        tskq_read(task_ring_head(r), rnbl_ptr, req, type, category, timestamp);
+        r->head++;
+        return 0;
+}
+
+/*
+ * Local deques are filled by a single producer, the worker's dispatcher, which
+ * publishes a batch by moving tail. Any worker may consume: it copies the head
+ * task out and then claims it by advancing head with a CAS, so a task is only
+ * overwritten after whoever took it has its copy.
+ */
+struct local_deque {
+        volatile uint32_t head;
+        char make_it_64_bytes[60];
+        volatile uint32_t tail;
+        char make_it_64_bytes2[60];
+        struct task tasks[LOCAL_DEQUE_LEN];
+} __attribute__((aligned(64)));
+
+struct task_result {
+        void * rnbl;
+        struct request * req;
+        uint64_t timestamp;
+        uint8_t type;
+        uint8_t flag;   /* FINISHED or PREEMPTED */
+        char make_it_32_bytes[6];
+} __attribute__((packed, aligned(32)));
+
+/* Single-producer (the worker), single-consumer (its dispatcher) ring. */
+struct local_results {
+        volatile uint32_t head;
+        char make_it_64_bytes[60];
+        volatile uint32_t tail;
+        char make_it_64_bytes2[60];
+        struct task_result results[LOCAL_RESULTS_LEN];
+} __attribute__((aligned(64)));
+
+static inline uint32_t local_deque_len(struct local_deque * dq)
+{
+        return dq->tail - dq->head;
+}
 
+/**
+ * local_deque_take - claims the oldest task of a local deque
+ * @dq: the deque, owned by any worker
+ * @tsk: filled with the task
+ *
+ * Returns 0 if a task was claimed, -1 if the deque is empty.
+ */
+static inline int local_deque_take(struct local_deque * dq, struct task * tsk)
+{
+        uint32_t head;
+
+        do {
+                head = dq->head;
+                if (head == dq->tail)
+                        return -1;
+                barrier();
+                *tsk = dq->tasks[head & LOCAL_DEQUE_MASK];
+        } while (!__sync_bool_compare_and_swap(&dq->head, head, head + 1));
+        return 0;
+}
 
+static inline void local_results_push(struct local_results * r, void * rnbl,
+                                      struct request * req, uint8_t type,
+                                      uint64_t timestamp, uint8_t flag)
+{
+        struct task_result * res;
+        uint32_t tail = r->tail;
+
+        while (tail - r->head == LOCAL_RESULTS_LEN);
+        res = &r->results[tail & LOCAL_RESULTS_MASK];
+        res->rnbl = rnbl;
+        res->req = req;
+        res->type = type;
+        res->timestamp = timestamp;
+        res->flag = flag;
+        barrier();
+        r->tail = tail + 1;
 }
+
 static inline uint64_t get_queue_timestamp(struct task_queue * tq, uint64_t * timestamp)
 {
-        if (tq->head == NULL)
+        struct task_ring * r = tskq_oldest(tq);
+
+        if (!r)
             return -1;
-        (*timestamp) = tq->head->timestamp;
+        (*timestamp) = task_ring_head(r)->timestamp;
         return 0;
 }
 
@@ -336,140 +660,321 @@ static inline int naive_tskq_dequeue(struct task_queue * tq, void ** rnbl_ptr,
         return -1;
 }
 
+/**
+ * smart_tskq_dequeue - dequeues from the per-port queue with the least slack
+ * @tq: the array of per-port task queues
+ * @class: only ports in this priority class are considered
+ * @required_category: PACKET or CONTEXT to filter, NOCONTENT for any
+ * @cur_time: the current timestamp
+ *
+ * The head of each port's queue is its oldest task, so the port whose head has
+ * waited the largest fraction of its SLO is the one closest to a violation.
+ */
 static inline int smart_tskq_dequeue(struct task_queue * tq, void ** rnbl_ptr,
                                      struct request ** req, uint8_t *type,
                                      uint8_t *category, uint64_t *timestamp,
-                                     uint64_t cur_time)
+                                     uint64_t cur_time, uint8_t class,
+                                     uint8_t required_category)
 {
         int i, ret;
         uint64_t queue_stamp;
         int index = -1;
-        double max = 0;
+        double max = -1;
 
         for (i = 0; i < CFG.num_ports; i++) {
-                ret = get_queue_timestamp(&tq[i], &queue_stamp);
-                if (ret)
+                if (CFG.prios[i] != class)
                         continue;
+                if (required_category == NOCONTENT) {
+                        ret = get_queue_timestamp(&tq[i], &queue_stamp);
+                        if (ret)
+                                continue;
+                } else {
+                        struct task_ring * r = tskq_ring(&tq[i], required_category);
+                        if (!task_ring_len(r))
+                                continue;
+                        queue_stamp = task_ring_head(r)->timestamp;
+                }
 
                 int64_t diff = cur_time - queue_stamp;
-                double current = diff / CFG.slos[i];
+                double current = (double) diff / CFG.slo_cycles[i];
                 if (current > max) {
                         max = current;
                         index = i;
                 }
         }
 
-        if (index != -1) {
+        if (index == -1)
+                return -1;
+        if (required_category == NOCONTENT)
                 return tskq_dequeue(&tq[index], rnbl_ptr, req, type, category,
                                     timestamp);
+        return tskq_dequeue_category(&tq[index], rnbl_ptr, req, type, category,
+                                     timestamp, required_category);
+}
+
+/*
+ * Binary min-heap of task descriptors, used by the policies whose order is a
+ * fixed per-task key (SRPT and EDF). Like the rings there is one heap per
+ * category, so a category-filtered dequeue stays a single pop. Ties on the
+ * key are broken by the descriptor's enqueue sequence number, so tasks with
+ * equal keys still leave in FCFS order.
+ */
+struct task_heap
+{
+        uint32_t len;
+        uint64_t * keys;
+        struct task * tasks;
+};
+
+static inline int task_heap_before(struct task_heap * a, uint32_t i,
+                                   struct task_heap * b, uint32_t j)
+{
+        if (a->keys[i] != b->keys[j])
+                return a->keys[i] < b->keys[j];
+        return (int32_t)(a->tasks[i].seq - b->tasks[j].seq) < 0;
+}
+
+static inline void task_heap_swap(struct task_heap * h, uint32_t a, uint32_t b)
+{
+        uint64_t key = h->keys[a];
+        struct task tsk = h->tasks[a];
+
+        h->keys[a] = h->keys[b];
+        h->tasks[a] = h->tasks[b];
+        h->keys[b] = key;
+        h->tasks[b] = tsk;
+}
+
+static inline int task_heap_push(struct task_heap * h, uint64_t key,
+                                 uint32_t seq, void * rnbl,
+                                 struct request * req, uint8_t type,
+                                 uint8_t category, uint64_t timestamp)
+{
+        uint32_t i, parent;
+
+        if (unlikely(h->len == TASK_QUEUE_SIZE))
+                return -1;
+        i = h->len++;
+        h->keys[i] = key;
+        tskq_fill(&h->tasks[i], rnbl, req, type, category, timestamp, seq);
+        while (i) {
+                parent = (i - 1) / 2;
+                if (!task_heap_before(h, i, h, parent))
+                        break;
+                task_heap_swap(h, i, parent);
+                i = parent;
         }
-        return -1;
+        return 0;
 }
 
-static inline struct request * rq_update(struct request_queue * rq, struct mbuf * pkt)
-{
-	// Quickly parse packet without doing checks
-        struct eth_hdr * ethhdr = mbuf_mtod(pkt, struct eth_hdr *);
-        struct ip_hdr *  iphdr = mbuf_nextd(ethhdr, struct ip_hdr *);
-        int hdrlen = iphdr->header_len * sizeof(uint32_t);
-	struct udp_hdr * udphdr = mbuf_nextd_off(iphdr, struct udp_hdr *,
-                                                 hdrlen);
-	// Get data and udp header
-	void * data = mbuf_nextd(udphdr, void *);
-	struct message * msg = (struct message *) data;
-
-	uint16_t type = msg->type - req_offset;
-        log_debug("RQ received packet type %d\n", type);
-        uint16_t seq_num = msg->seq_num;
-        uint16_t client_id = msg->client_id;
-        uint32_t req_id = msg->req_id;
-        uint32_t pkts_length = msg->pkts_length / sizeof(struct message);
-	if (pkts_length == 1) {
-		struct request * req = mempool_alloc(&request_mempool);
-        if (unlikely(!req)) {
-            mbuf_free(pkt);
-            return NULL;
+static inline int task_heap_pop(struct task_heap * h, void ** rnbl_ptr,
+                                struct request ** req, uint8_t *type,
+                                uint8_t *category, uint64_t *timestamp)
+{
+        uint32_t i = 0, child;
+
+        if (!h->len)
+                return -1;
+        tskq_read(&h->tasks[0], rnbl_ptr, req, type, category, timestamp);
+        h->len--;
+        h->keys[0] = h->keys[h->len];
+        h->tasks[0] = h->tasks[h->len];
+        while ((child = 2 * i + 1) < h->len) {
+                if (child + 1 < h->len &&
+                    task_heap_before(h, child + 1, h, child))
+                        child++;
+                if (!task_heap_before(h, child, h, i))
+                        break;
+                task_heap_swap(h, i, child);
+                i = child;
         }
-		req->type = type;
-		req->pkts_length = 1;
-		req->mbufs[0] = pkt;
-		return req;
-	}
-
-        if (!rq->head) {
-                struct request_cell * rc = mempool_alloc(&rq_mempool);
-                rc->pkts_remaining = pkts_length - 1;
-                rc->client_id = client_id;
-                rc->req_id = req_id;
-                rc->req = mempool_alloc(&request_mempool);
-                rc->req->mbufs[seq_num] = pkt;
-                rc->req->pkts_length = pkts_length;
-                rc->req->type = type;
-                rc->next = NULL;
-                rc->prev = NULL;
-                rq->head = rc;
-                return NULL;
+        return 0;
+}
+
+/*
+ * Scheduling policy layer. Every dispatcher owns the structure backing the
+ * policy selected with sched_policy= in the configuration:
+ *
+ *   fcfs - the two-ring task queue (tskq), oldest task first
+ *   slo  - one task queue per port (tskq_ports), least SLO slack first
+ *   srpt - task heaps keyed by the client's runNs minus service received
+ *   edf  - task heaps keyed by arrival timestamp plus the port's SLO
+ *
+ * Tasks are first split by the priority class of their type (priority= in
+ * the configuration, 0 being the highest). A class is only served when all
+ * higher classes are empty, and the policy orders the tasks within a class.
+ *
+ * Preempted contexts are re-queued through sched_enqueue() as well, so they
+ * are ordered by the same policy as new packets.
+ */
+extern __thread struct task_queue tskq[SCHED_MAX_CLASSES];
+extern __thread struct task_queue tskq_ports[CFG_MAX_PORTS];
+extern __thread struct task_heap task_heaps[SCHED_MAX_CLASSES][TASK_CATEGORIES];
+extern __thread uint32_t sched_queued;
+extern __thread uint32_t sched_seq;
+extern __thread uint32_t sched_class_queued[SCHED_MAX_CLASSES];
+
+extern int sched_init(void);
+
+static inline uint8_t sched_port(uint8_t type)
+{
+        return likely(type < CFG.num_ports) ? type : 0;
+}
+
+static inline uint8_t sched_class(uint8_t type)
+{
+        return CFG.prios[sched_port(type)];
+}
+
+static inline uint64_t sched_key(struct request * req, uint8_t type,
+                                 uint64_t timestamp)
+{
+        if (CFG.sched_policy == SCHED_EDF)
+                return timestamp + CFG.slo_cycles[sched_port(type)];
+        if (unlikely(!req) || req->service_ns >= req->size_hint)
+                return 0;
+        return req->size_hint - req->service_ns;
+}
+
+static inline int sched_enqueue(void * rnbl, struct request * req,
+                                uint8_t type, uint8_t category,
+                                uint64_t timestamp)
+{
+        uint8_t class = sched_class(type);
+        int ret;
+
+        switch (CFG.sched_policy) {
+        case SCHED_SLO:
+                ret = tskq_enqueue_tail(&tskq_ports[sched_port(type)], rnbl,
+                                        req, type, category, timestamp);
+                break;
+        case SCHED_SRPT:
+        case SCHED_EDF:
+                ret = task_heap_push(&task_heaps[class][category - PACKET],
+                                     sched_key(req, type, timestamp),
+                                     sched_seq++, rnbl, req, type, category,
+                                     timestamp);
+                break;
+        default:
+                ret = tskq_enqueue_tail(&tskq[class], rnbl, req, type,
+                                        category, timestamp);
         }
-	struct request_cell * cur = rq->head;
-        while (cur != NULL) {
-                if (cur->client_id == client_id && cur->req_id == req_id) {
-                        cur->req->mbufs[seq_num] = pkt;
-                        cur->pkts_remaining--;
-			if (cur->pkts_remaining == 0) {
-				struct request * req = cur->req;
-				if (cur->prev == NULL) {
-					rq->head = cur->next;
-					if (rq->head != NULL)
-						rq->head->prev = NULL;
-				} else {
-					cur->prev->next = cur->next;
-					if (cur->next != NULL)
-						cur->next->prev = cur->prev;
-				}
-				mempool_free(&rq_mempool, cur);
-				return req;
-			}
-			return NULL;
-		}
-		cur = cur->next;
+        if (likely(!ret)) {
+                sched_queued++;
+                sched_class_queued[class]++;
         }
+        return ret;
+}
 
-        if (cur == NULL) {
-                struct request_cell * rc = mempool_alloc(&rq_mempool);
-                rc->pkts_remaining = pkts_length - 1;
-                rc->client_id = client_id;
-                rc->req_id = req_id;
-                rc->req = mempool_alloc(&request_mempool);
-                rc->req->mbufs[seq_num] = pkt;
-                rc->req->pkts_length = pkts_length;
-                rc->req->type = type;
-                rc->next = rq->head;
-		rc->next->prev = rc;
-		rc->prev = NULL;
-                rq->head = rc;
-                return NULL;
+static inline int sched_dequeue_class(uint8_t class, void ** rnbl_ptr,
+                                      struct request ** req, uint8_t *type,
+                                      uint8_t *category, uint64_t *timestamp,
+                                      uint64_t cur_time,
+                                      uint8_t required_category)
+{
+        struct task_heap * h;
+
+        switch (CFG.sched_policy) {
+        case SCHED_SLO:
+                return smart_tskq_dequeue(tskq_ports, rnbl_ptr, req, type,
+                                          category, timestamp, cur_time,
+                                          class, required_category);
+        case SCHED_SRPT:
+        case SCHED_EDF:
+                h = task_heaps[class];
+                if (required_category != NOCONTENT)
+                        h += required_category - PACKET;
+                else if (!h[0].len ||
+                         (h[1].len && task_heap_before(&h[1], 0, &h[0], 0)))
+                        h++;
+                return task_heap_pop(h, rnbl_ptr, req, type, category,
+                                     timestamp);
+        default:
+                if (required_category != NOCONTENT)
+                        return tskq_dequeue_category(&tskq[class], rnbl_ptr,
+                                                     req, type, category,
+                                                     timestamp,
+                                                     required_category);
+                return tskq_dequeue(&tskq[class], rnbl_ptr, req, type,
+                                    category, timestamp);
         }
-        return NULL;
 }
 
+/**
+ * sched_dequeue_category - dequeues the next task according to the policy
+ * @required_category: PACKET or CONTEXT to filter, NOCONTENT for any
+ * @cur_time: the current timestamp
+ *
+ * Returns 0 if a task was dequeued, -1 if there is none.
+ */
+static inline int sched_dequeue_category(void ** rnbl_ptr, struct request ** req,
+                                         uint8_t *type, uint8_t *category,
+                                         uint64_t *timestamp, uint64_t cur_time,
+                                         uint8_t required_category)
+{
+        uint8_t class;
+
+        for (class = 0; class < CFG.sched_classes; class++) {
+                if (!sched_class_queued[class])
+                        continue;
+                if (sched_dequeue_class(class, rnbl_ptr, req, type, category,
+                                        timestamp, cur_time,
+                                        required_category))
+                        continue;
+                sched_queued--;
+                sched_class_queued[class]--;
+                return 0;
+        }
+        return -1;
+}
+
+static inline int sched_dequeue(void ** rnbl_ptr, struct request ** req,
+                                uint8_t *type, uint8_t *category,
+                                uint64_t *timestamp, uint64_t cur_time)
+{
+        return sched_dequeue_category(rnbl_ptr, req, type, category, timestamp,
+                                      cur_time, NOCONTENT);
+}
+
+static inline int sched_is_empty(void)
+{
+        return sched_queued == 0;
+}
+
+static inline int sched_can_admit(void)
+{
+        return sched_queued < TASK_QUEUE_SIZE - TASK_QUEUE_RESERVED;
+}
+
+extern struct request * rq_update(struct request_queue * rq, struct mbuf * pkt);
+extern void request_free(struct request * req);
+
 static inline struct request * fake_work_rq_update(struct request_queue * rq, 
                                                 struct mbuf * pkt, uint16_t req_type)
 {
-        struct request * req = mempool_alloc(&request_mempool);
+        struct request * req = mempool_alloc(&percpu_get(request_mempool));
         if (unlikely(!req)) {
             mbuf_free(pkt);
             return NULL;
         }
         req->type = req_type;
         req->pkts_length = 1;
+        req->size_hint = 0;
+        req->service_ns = 0;
         req->mbufs[0] = pkt;
+        req->overflow = NULL;
         return req;
 }
 
-volatile struct jbsq_preemption preempt_check[MAX_WORKERS];
-volatile struct networker_pointers_t networker_pointers;
+volatile struct worker_status worker_status[MAX_WORKERS];
+struct preempt_counts preempt_counts[MAX_WORKERS];
+struct tx_stats tx_stats[MAX_WORKERS];
+volatile struct worker_slices worker_slices[MAX_WORKERS];
+struct networker_rings networker_rings[NUM_NETWORKERS][NUM_DISPATCHERS];
+volatile struct steal_request steal_requests[NUM_DISPATCHERS];
+volatile struct steal_batch steal_batches[NUM_DISPATCHERS];
 volatile struct jbsq_worker_response worker_responses[MAX_WORKERS];
 volatile struct jbsq_dispatcher_request dispatcher_requests[MAX_WORKERS];
 struct worker_state dispatch_states[MAX_WORKERS];
-uint8_t idle_list[MAX_WORKERS];
-uint8_t idle_list_head;
\ No newline at end of file
+struct local_deque local_deques[MAX_WORKERS];
+struct local_results local_results[MAX_WORKERS];
\ No newline at end of file
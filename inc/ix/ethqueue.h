@@ -40,9 +40,10 @@
 
 DECLARE_PERCPU(int, eth_num_queues);
 
-struct eth_rx_queue * eth_rxqs[NETHDEV];
-struct mbuf * recv_mbufs[ETH_RX_MAX_BATCH];
-int recv_type[ETH_RX_MAX_BATCH];
+/* Each networker cpu owns one RX queue per device. */
+DECLARE_PERCPU(struct eth_rx_queue *, eth_rxqs[NETHDEV]);
+DECLARE_PERCPU(struct mbuf *, recv_mbufs[ETH_RX_MAX_BATCH]);
+DECLARE_PERCPU(int, recv_type[ETH_RX_MAX_BATCH]);
 
 /*
  * Receive Queue API
@@ -89,7 +90,7 @@ static inline int eth_process_poll(void)
         struct eth_rx_queue *rxq;
 
         for (i = 0; i < percpu_get(eth_num_queues); i++) {
-                rxq = eth_rxqs[i];
+                rxq = percpu_get(eth_rxqs[i]);
                 count += eth_rx_poll(rxq);
         }
 
@@ -120,6 +121,8 @@ static inline int eth_process_recv(void)
         int i, type, count = 0;
         bool empty;
         struct mbuf * pos;
+        struct mbuf ** mbufs = percpu_get(recv_mbufs);
+        int * types = percpu_get(recv_type);
 
         /*
         * We round robin through each queue one packet at
@@ -129,11 +132,11 @@ static inline int eth_process_recv(void)
         do {
                 empty = true;
                 for (i = 0; i < percpu_get(eth_num_queues); i++) {
-                        struct eth_rx_queue *rxq = eth_rxqs[i];
+                        struct eth_rx_queue *rxq = percpu_get(eth_rxqs[i]);
                         type = eth_process_recv_queue(rxq, &pos);
                         if (type >= 0) {
-                                recv_mbufs[count] = pos;
-                                recv_type[count] = type;
+                                mbufs[count] = pos;
+                                types[count] = type;
                                 count++;
                                 empty = false;
                         }
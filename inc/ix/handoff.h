@@ -0,0 +1,235 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * handoff.h - single-producer/single-consumer rings between the networkers
+ * and the dispatchers
+ *
+ * Each side works on a private copy of its index and publishes it once per
+ * cache line of slots, or when it runs out of work. It reads the other
+ * side's index only when its cached copy says the ring is full or empty.
+ * The index lines thus move between the two cores about once per
+ * HANDOFF_BATCH requests rather than once per request, and neither side
+ * ever waits for the other while there is room or work.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <asm/cpu.h>
+#include <ix/compiler.h>
+#include <ix/stddef.h>
+#include <ix/types.h>
+
+/* Slots per ring, a power of two. */
+#ifndef HANDOFF_RING_LEN
+#define HANDOFF_RING_LEN 256
+#endif
+
+#if (HANDOFF_RING_LEN & (HANDOFF_RING_LEN - 1)) || HANDOFF_RING_LEN < 8
+#error "HANDOFF_RING_LEN must be a power of two of at least 8"
+#endif
+
+// If 1, times every request from push to pop and counts full rings
+#ifndef HANDOFF_STATS
+#define HANDOFF_STATS 0
+#endif
+
+/* Buckets of the push-to-pop latency histogram, one per power of two. */
+#define HANDOFF_LAT_BUCKETS 32
+
+struct request;
+
+struct handoff_slot {
+	struct request *req;
+	uint32_t type;
+	uint32_t tsc;	/* low half of the push time, with HANDOFF_STATS */
+};
+
+#define HANDOFF_BATCH   (64 / sizeof(struct handoff_slot))
+
+struct handoff_ring {
+	/* Published indices, each alone on its line. */
+	volatile uint32_t tail __aligned(64);
+	volatile uint32_t head __aligned(64);
+
+	/* Producer side, private to the producer. */
+	struct {
+		uint32_t next_tail;
+		uint32_t published;
+		uint32_t head_cache;
+		uint64_t full;		/* pushes refused, with HANDOFF_STATS */
+	} prod __aligned(64);
+
+	/* Consumer side, private to the consumer. */
+	struct {
+		uint32_t next_head;
+		uint32_t released;
+		uint32_t tail_cache;
+		/* Only kept with HANDOFF_STATS. */
+		uint64_t popped;
+		uint64_t lat_cycles;
+		uint64_t lat_max;
+		uint64_t lat_hist[HANDOFF_LAT_BUCKETS];
+	} cons __aligned(64);
+
+	struct handoff_slot slots[HANDOFF_RING_LEN] __aligned(64);
+};
+
+/**
+ * handoff_flush - makes the pushed requests visible to the consumer
+ * @r: the ring
+ */
+static inline void handoff_flush(struct handoff_ring *r)
+{
+	if (r->prod.next_tail == r->prod.published)
+		return;
+	r->prod.published = r->prod.next_tail;
+	/* x86 keeps stores in order; only the compiler must be held back. */
+	barrier();
+	r->tail = r->prod.published;
+}
+
+/**
+ * handoff_push - adds a request to a ring
+ * @r: the ring
+ * @req: the request
+ * @type: the request type, handed over so the consumer need not read @req
+ *
+ * The request is published with the rest of its cache line, or by the next
+ * handoff_flush().
+ *
+ * Returns true if successful, false if the ring is full.
+ */
+static inline bool handoff_push(struct handoff_ring *r, struct request *req,
+				uint32_t type)
+{
+	uint32_t t = r->prod.next_tail;
+	struct handoff_slot *s;
+
+	if (unlikely(t - r->prod.head_cache == HANDOFF_RING_LEN)) {
+		r->prod.head_cache = r->head;
+		barrier();
+		if (t - r->prod.head_cache == HANDOFF_RING_LEN) {
+#if HANDOFF_STATS == 1
+			r->prod.full++;
+#endif
+			return false;
+		}
+	}
+
+	s = &r->slots[t & (HANDOFF_RING_LEN - 1)];
+	s->req = req;
+	s->type = type;
+#if HANDOFF_STATS == 1
+	s->tsc = (uint32_t) rdtsc();
+#endif
+	r->prod.next_tail = ++t;
+	if (!(t & (HANDOFF_BATCH - 1)))
+		handoff_flush(r);
+	return true;
+}
+
+/**
+ * handoff_release - hands the slots of the popped requests back to the producer
+ * @r: the ring
+ */
+static inline void handoff_release(struct handoff_ring *r)
+{
+	if (r->cons.next_head == r->cons.released)
+		return;
+	r->cons.released = r->cons.next_head;
+	/* The slots must be read before the producer may reuse them. */
+	barrier();
+	r->head = r->cons.released;
+}
+
+#if HANDOFF_STATS == 1
+static inline void handoff_account(struct handoff_ring *r, uint32_t tsc)
+{
+	uint32_t lat = (uint32_t) rdtsc() - tsc;
+
+	r->cons.lat_cycles += lat;
+	if (lat > r->cons.lat_max)
+		r->cons.lat_max = lat;
+	r->cons.lat_hist[lat ? 32 - __builtin_clz(lat) - 1 : 0]++;
+}
+#endif
+
+/**
+ * handoff_pop - takes the oldest request off a ring
+ * @r: the ring
+ * @req: set to the request
+ * @type: set to its type
+ *
+ * The slot is handed back with the rest of its cache line, or by the next
+ * handoff_release().
+ *
+ * Returns true if successful, false if the ring is empty.
+ */
+static inline bool handoff_pop(struct handoff_ring *r, struct request **req,
+			       uint32_t *type)
+{
+	uint32_t h = r->cons.next_head;
+	struct handoff_slot *s;
+
+	if (h == r->cons.tail_cache) {
+		r->cons.tail_cache = r->tail;
+		barrier();
+		if (h == r->cons.tail_cache)
+			return false;
+	}
+
+	s = &r->slots[h & (HANDOFF_RING_LEN - 1)];
+	*req = s->req;
+	*type = s->type;
+#if HANDOFF_STATS == 1
+	r->cons.popped++;
+	handoff_account(r, s->tsc);
+#endif
+	r->cons.next_head = ++h;
+	if (!(h & (HANDOFF_BATCH - 1)))
+		handoff_release(r);
+	return true;
+}
+
+/**
+ * handoff_lat_pct - an upper bound of a push-to-pop latency percentile
+ * @r: the ring
+ * @pct: the percentile, between 0 and 100
+ *
+ * Returns the bound in cycles, a power of two.
+ */
+static inline uint64_t handoff_lat_pct(struct handoff_ring *r, int pct)
+{
+	uint64_t seen = 0, want = r->cons.popped * pct / 100;
+	int i;
+
+	for (i = 0; i < HANDOFF_LAT_BUCKETS - 1; i++) {
+		seen += r->cons.lat_hist[i];
+		if (seen >= want)
+			break;
+	}
+	return 2UL << i;
+}
@@ -1,5 +0,0 @@
-#pragma once
-
-#include <stdint.h>
-
-extern __thread volatile uint8_t clear_ints;
\ No newline at end of file
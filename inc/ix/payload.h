@@ -0,0 +1,64 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * payload.h - scatter-gather views of a request's payload
+ *
+ * Every packet of a request carries a struct message followed by a part of
+ * the payload. A payload view lists those parts in sequence order, so that a
+ * handler can read the payload as one contiguous range of bytes while it
+ * stays in the packets it arrived in.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct mbuf;
+struct request;
+struct message;
+
+struct payload_seg {
+	const char * base;
+	uint32_t len;
+};
+
+/* Has room for one segment per packet, see payload_view_size(). */
+struct payload_view {
+	struct message * msg;   /* header of the first packet */
+	uint32_t len;           /* total payload length */
+	uint32_t nr_segs;
+	struct payload_seg segs[];
+};
+
+/* Bytes needed by the view of a request of @nr_pkts packets. */
+#define payload_view_size(nr_pkts) \
+	(sizeof(struct payload_view) + (nr_pkts) * sizeof(struct payload_seg))
+
+extern struct message * payload_msg(struct mbuf * pkt, uint32_t * len);
+extern int payload_view_init(struct payload_view * v, struct request * req);
+extern size_t payload_copy(const struct payload_view * v, size_t off,
+			   void * dst, size_t len);
+extern const char * payload_slice(const struct payload_view * v, size_t off,
+				  size_t len, char * scratch);
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * preempt_trace.h - tracing of the Concord preemption points
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <asm/cpu.h>
+#include <ix/compiler.h>
+#include <ix/types.h>
+
+/* Events kept per worker; the oldest ones are overwritten. */
+#define PTRACE_RING_SHIFT   14
+#define PTRACE_RING_SIZE    (1 << PTRACE_RING_SHIFT)
+#define PTRACE_RING_MASK    (PTRACE_RING_SIZE - 1)
+
+#define PTRACE_FILE         "preempt_trace.bin"
+
+enum {
+	/* The dispatcher raised the preemption flag; @cycles is 0. */
+	PTRACE_FLAG_SET = 0,
+	/* The worker yielded; @cycles since the flag was raised. */
+	PTRACE_YIELD,
+	/* A probe saw the flag under a lock; @cycles since the flag was raised. */
+	PTRACE_DEFER,
+	/* concord_lock_counter dropped back to 0; @cycles it was held. */
+	PTRACE_LOCK_HOLD,
+};
+
+/*
+ * One event, also the record format of PTRACE_FILE: a flat array of these,
+ * worker by worker, each worker's events oldest first.
+ */
+struct ptrace_event {
+	uint64_t tsc;
+	uint32_t cycles;
+	uint16_t type;
+	uint16_t worker;
+};
+
+struct ptrace_ring {
+	/* Written by the dispatcher when it raises the flag. */
+	volatile uint64_t flag_tsc;
+	uint64_t pad0[7];
+	/* Only touched by the worker. */
+	uint64_t head;
+	uint64_t lock_tsc;
+	uint64_t seen_flag_tsc;
+	uint64_t pad1[5];
+	struct ptrace_event events[PTRACE_RING_SIZE];
+} __aligned(64);
+
+/* One per worker, MAX_WORKERS of them. */
+extern struct ptrace_ring ptrace_rings[];
+
+/* Ring of the calling thread, NULL unless it is a worker. */
+extern __thread struct ptrace_ring *ptrace_ring;
+extern __thread uint16_t ptrace_worker;
+
+static inline void ptrace_record(struct ptrace_ring *r, uint16_t type,
+				 uint64_t tsc, uint64_t cycles)
+{
+	struct ptrace_event *e = &r->events[r->head++ & PTRACE_RING_MASK];
+
+	e->tsc = tsc;
+	e->cycles = cycles > UINT32_MAX ? UINT32_MAX : cycles;
+	e->type = type;
+	e->worker = ptrace_worker;
+}
+
+/**
+ * ptrace_flag_set - notes that the dispatcher raised a worker's flag
+ * @worker: the worker
+ * @tsc: the time the flag was raised
+ */
+static inline void ptrace_flag_set(uint8_t worker, uint64_t tsc)
+{
+	ptrace_rings[worker].flag_tsc = tsc;
+}
+
+/**
+ * ptrace_probe - records a probe that found the preemption flag raised
+ * @deferred: whether the yield is held back by concord_lock_counter
+ *
+ * The flag stays raised while a lock is held, so every probe in the critical
+ * section ends up here; the flag and the deferral are only recorded once.
+ */
+static inline void ptrace_probe(bool deferred)
+{
+	struct ptrace_ring *r = ptrace_ring;
+	uint64_t now, flag_tsc;
+
+	if (!r)
+		return;
+	now = rdtsc();
+	flag_tsc = r->flag_tsc;
+	if (r->seen_flag_tsc != flag_tsc) {
+		r->seen_flag_tsc = flag_tsc;
+		ptrace_record(r, PTRACE_FLAG_SET, flag_tsc, 0);
+		if (deferred)
+			ptrace_record(r, PTRACE_DEFER, now, now - flag_tsc);
+	}
+	if (!deferred)
+		ptrace_record(r, PTRACE_YIELD, now, now - flag_tsc);
+}
+
+/* Called when concord_lock_counter leaves 0. */
+static inline void ptrace_lock_acquire(void)
+{
+	if (ptrace_ring)
+		ptrace_ring->lock_tsc = rdtsc();
+}
+
+/* Called when concord_lock_counter gets back to 0. */
+static inline void ptrace_lock_release(void)
+{
+	struct ptrace_ring *r = ptrace_ring;
+	uint64_t now;
+
+	if (!r)
+		return;
+	now = rdtsc();
+	ptrace_record(r, PTRACE_LOCK_HOLD, now, now - r->lock_tsc);
+}
+
+extern void ptrace_init_worker(uint8_t worker);
+extern int ptrace_dump(int nr_workers);
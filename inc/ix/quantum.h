@@ -0,0 +1,88 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * quantum.h - adaptive preemption time slice
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <ix/cfg.h>
+#include <ix/compiler.h>
+
+/*
+ * Service times are kept in log-linear histograms: every power of two is
+ * split into 2^QUANTUM_HIST_SUB_BITS equal buckets, so a bucket is at most
+ * 25% wide and 256 buckets cover the whole uint64_t range of nanoseconds.
+ */
+#define QUANTUM_HIST_SUB_BITS   2
+#define QUANTUM_HIST_BUCKETS    256
+
+/* Bounds of the time slice picked by the controller, in ns. */
+#define QUANTUM_MIN_NS          1000
+#define QUANTUM_MAX_NS          200000
+
+/* How often the time slice is retuned, in us. */
+#define QUANTUM_EPOCH_US        10000
+
+/* Retuning is skipped until this many completions have been observed. */
+#define QUANTUM_MIN_SAMPLES     1000
+
+/* Percentage of requests that should complete within a single slice. */
+#define QUANTUM_PERCENTILE      90
+
+struct service_hist {
+	uint64_t total;
+	uint64_t counts[QUANTUM_HIST_BUCKETS];
+};
+
+extern __thread struct service_hist service_hists[CFG_MAX_PORTS];
+
+extern uint64_t quantum_retune(uint64_t quantum);
+
+static inline unsigned int service_hist_bucket(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < (1 << QUANTUM_HIST_SUB_BITS))
+		return ns;
+	msb = 63 - clz64(ns);
+	return ((msb - QUANTUM_HIST_SUB_BITS + 1) << QUANTUM_HIST_SUB_BITS) |
+	       ((ns >> (msb - QUANTUM_HIST_SUB_BITS)) &
+		((1 << QUANTUM_HIST_SUB_BITS) - 1));
+}
+
+/**
+ * service_hist_record - accounts a completed request
+ * @type: the request type (port index)
+ * @ns: the service time the request received in total
+ */
+static inline void service_hist_record(uint8_t type, uint64_t ns)
+{
+	struct service_hist *h = &service_hists[type];
+
+	h->counts[service_hist_bucket(ns)]++;
+	h->total++;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2018-19 Board of Trustees of Stanford University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * stack.h - guard-paged request stacks in several size classes
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <ix/cfg.h>
+#include <ix/cpu.h>
+#include <ix/lock.h>
+#include <ix/log.h>
+#include <ix/mem.h>
+#include <ix/stddef.h>
+
+/*
+ * Every stack sits right above an unmapped 4KB guard page, so an overflow
+ * faults instead of running into the stack below. The size classes are in
+ * cfg.h.
+ */
+#define STACK_GUARD_SIZE        PGSIZE_4KB
+
+/* Stacks kept by each cpu before it goes to the shared free list. */
+#define STACK_CACHE_SIZE        128
+
+/*
+ * One stack in 2^STACK_SAMPLE_SHIFT allocations has its usage measured: it
+ * is filled with STACK_CANARY, and so is its tag, kept in the 16 bytes at
+ * the top of every stack that the context never uses.
+ */
+#define STACK_SAMPLE_SHIFT      10
+#define STACK_CANARY            0x5354434b43414e59UL
+#define STACK_TAG_SIZE          16
+
+/*
+ * Stacks, and the contexts that run on them, are allocated per NUMA node.
+ * Nodes with no worker get no memory.
+ */
+#define STACK_MAX_NODES         4
+
+struct stack_class {
+	size_t size;
+	uintptr_t base;
+	uintptr_t end;
+	uint8_t node;
+	uint8_t cls;
+	spinlock_t lock;
+	void **free;
+	int nr_free;
+};
+
+struct stack_cache {
+	int cnt;
+	void *stacks[STACK_CACHE_SIZE];
+};
+
+extern struct stack_class stack_classes[STACK_MAX_NODES][STACK_NR_CLASSES];
+DECLARE_PERCPU(struct stack_cache, stack_caches[STACK_MAX_NODES][STACK_NR_CLASSES]);
+DECLARE_PERCPU(uint32_t, stack_allocs);
+
+/* NUMA node of every cpu, folded into [0, STACK_MAX_NODES). */
+extern uint8_t cpu_nodes[NCPU];
+
+extern int stack_init(void);
+extern int stack_node_share(int capacity, int node);
+extern void *stack_refill(struct stack_cache *c, struct stack_class *sc);
+extern void stack_drain(struct stack_cache *c, struct stack_class *sc);
+extern void stack_paint(void *stack, struct stack_class *sc);
+extern void stack_sample(void *stack, struct stack_class *sc, uint8_t type);
+extern bool stack_is_guard(uintptr_t addr);
+
+/* Class of the stacks of request type @type. */
+static inline int stack_type_class(uint8_t type)
+{
+	if (type < CFG.num_stack_sizes)
+		return CFG.stack_sizes[type];
+	return STACK_CLASS_16KB;
+}
+
+/*
+ * Class and node of a stack, found by the range of its region. Anything
+ * else is a bug, not a stack to be filed under some class.
+ */
+static inline struct stack_class *stack_class_of(void *stack)
+{
+	struct stack_class *sc = &stack_classes[0][0];
+	uintptr_t p = (uintptr_t) stack;
+	int i;
+
+	for (i = 0; i < STACK_MAX_NODES * STACK_NR_CLASSES; i++, sc++) {
+		if (p >= sc->base && p < sc->end)
+			return sc;
+	}
+	panic("stack: %p is not a request stack\n", stack);
+}
+
+/* NUMA node a stack was allocated on. */
+static inline int stack_node(void *stack)
+{
+	return stack_class_of(stack)->node;
+}
+
+/* Bytes of a stack of class @cls available to the context. */
+static inline size_t stack_size(int cls)
+{
+	return stack_classes[0][cls].size - STACK_TAG_SIZE;
+}
+
+static inline uint64_t *stack_tag(void *stack, int cls)
+{
+	return (uint64_t *) ((uintptr_t) stack + stack_size(cls));
+}
+
+/**
+ * stack_alloc - allocates a stack from the per-cpu cache of a class
+ * @cls: the size class
+ * @node: the NUMA node the stack must be on
+ *
+ * Returns the lowest address of the stack, or NULL if the class ran out on
+ * that node.
+ */
+static inline void *stack_alloc(int cls, int node)
+{
+	struct stack_cache *c = &percpu_get(stack_caches)[node][cls];
+	void *stack;
+
+	if (unlikely(!c->cnt))
+		stack = stack_refill(c, &stack_classes[node][cls]);
+	else
+		stack = c->stacks[--c->cnt];
+
+	if (unlikely(!(++percpu_get(stack_allocs) & ((1 << STACK_SAMPLE_SHIFT) - 1))) && stack)
+		stack_paint(stack, &stack_classes[node][cls]);
+	return stack;
+}
+
+/**
+ * stack_free - returns a stack to the per-cpu cache of its class and node
+ * @stack: the stack
+ * @type: the type of the request that ran on it
+ *
+ * A sampled stack reports how deep the request went first.
+ */
+static inline void stack_free(void *stack, uint8_t type)
+{
+	struct stack_class *sc = stack_class_of(stack);
+	struct stack_cache *c = &percpu_get(stack_caches)[sc->node][sc->cls];
+
+	if (unlikely(*stack_tag(stack, sc->cls) == STACK_CANARY))
+		stack_sample(stack, sc, type);
+
+	if (unlikely(c->cnt == STACK_CACHE_SIZE))
+		stack_drain(c, sc);
+	c->stacks[c->cnt++] = stack;
+}